@@ -0,0 +1,132 @@
+/* 
+ * parsebench - Compare the command line lexer of tsh with the original
+ *    parseline on short, medium and huge command lines.
+ *
+ * Build and run with "make bench". Each line size prints one JSON
+ * object, with parseline_ns null when the line is too long for it.
+ *
+ * The shell is compiled into this program with its main renamed, so
+ * the benchmark always measures the lexer of the tree it is built from.
+ */
+#define main tsh_main
+#include "../tsh.c"
+#undef main
+
+#define OLDMAXARGS 128      /* limits of the original parseline */
+
+/* 
+ * old_parseline - The original parseline, kept for comparison.
+ *    Characters enclosed in single quotes are treated as a single
+ *    argument. Return true if the user has requested a BG job.
+ */
+int old_parseline(const char *cmdline, char **argv) 
+{
+    static char array[MAXLINE]; /* holds local copy of command line */
+    char *buf = array;          /* ptr that traverses command line */
+    char *delim;                /* points to first space delimiter */
+    int argc;                   /* number of args */
+    int bg;                     /* background job? */
+
+    strcpy(buf, cmdline);
+    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
+    while (*buf && (*buf == ' ')) /* ignore leading spaces */
+	buf++;
+
+    /* Build the argv list */
+    argc = 0;
+    if (*buf == '\'') {
+	buf++;
+	delim = strchr(buf, '\'');
+    }
+    else {
+	delim = strchr(buf, ' ');
+    }
+
+    while (delim) {
+	argv[argc++] = buf;
+	*delim = '\0';
+	buf = delim + 1;
+	while (*buf && (*buf == ' ')) /* ignore spaces */
+	       buf++;
+
+	if (*buf == '\'') {
+	    buf++;
+	    delim = strchr(buf, '\'');
+	}
+	else {
+	    delim = strchr(buf, ' ');
+	}
+    }
+    argv[argc] = NULL;
+    
+    if (argc == 0)  /* ignore blank line */
+	return 1;
+
+    /* should the job run in the background? */
+    if ((bg = (*argv[argc-1] == '&')) != 0) {
+	argv[--argc] = NULL;
+    }
+    return bg;
+}
+
+/* makeline - Build a line of nargs words of about wordlen bytes each */
+static char *makeline(int nargs, int wordlen)
+{
+    char *line = malloc((size_t)nargs * (wordlen + 8) + 16), *p = line;
+    int i;
+
+    if (line == NULL)
+	unix_error("makeline error");
+    p += sprintf(p, "/bin/echo");
+    for (i = 1; i < nargs; i++)
+	p += sprintf(p, " %.*s%d", wordlen, "abcdefghijklmnopqrstuvwxyz", i);
+    sprintf(p, " &\n");
+    return line;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* bench - Time both parsers on a line, the old one only if it fits */
+static void bench(const char *name, int nargs, int wordlen, long iters)
+{
+    static struct lexer_t lx;
+    char *line = makeline(nargs, wordlen), *argv[OLDMAXARGS];
+    size_t len = strlen(line);
+    volatile long sink = 0;
+    double t, tnew, told = 0;
+    long i;
+
+    t = now();
+    for (i = 0; i < iters; i++)
+	sink += lexline(&lx, line, len);
+    tnew = now() - t;
+
+    if (len < MAXLINE && nargs < OLDMAXARGS) {
+	t = now();
+	for (i = 0; i < iters; i++)
+	    sink += old_parseline(line, argv);
+	told = now() - t;
+    }
+
+    printf("{\"bench\":\"parse_%s\",\"args\":%d,\"bytes\":%zu,"
+	   "\"lexline_ns\":%.1f,", name, nargs, len, tnew / iters * 1e9);
+    if (told > 0)
+	printf("\"parseline_ns\":%.1f}\n", told / iters * 1e9);
+    else
+	printf("\"parseline_ns\":null}\n");
+    free(line);
+}
+
+int main(void)
+{
+    bench("short", 4, 4, 2000000);
+    bench("medium", 60, 8, 200000);
+    bench("huge", 20000, 12, 200);
+    return 0;
+}
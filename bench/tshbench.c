@@ -0,0 +1,384 @@
+/* 
+ * tshbench - Benchmarks for the launch, reap and signal paths of tsh
+ *    and for its lexer, script cache and job table.
+ *
+ * Build and run with "make bench". Each benchmark prints one JSON
+ * object per line on stdout, for example
+ *
+ *   {"bench":"launch","iters":2000,"ops_per_sec":5120.3,"mean_us":195.3}
+ *
+ * Latency benchmarks also report p50_us, p99_us and max_us. Whatever
+ * the shell itself prints (job notices and so on) goes to /dev/null.
+ *
+ * usage: tshbench [-n scale] [benchmark ...]
+ *
+ * The shell is compiled into this program with its main renamed, so
+ * the benchmarks always measure the code of the tree they are built
+ * from, through the same functions the shell uses.
+ */
+#define main tsh_main
+#include "../tsh.c"
+#undef main
+#include <dirent.h>
+
+FILE *results;              /* where the JSON lines go */
+int scale = 1;              /* multiplies the iteration counts */
+int zygsock;                /* socket to the fork server */
+
+/* now - Monotonic time in seconds */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* report - Print the result of a throughput benchmark */
+static void report(const char *name, long iters, double secs)
+{
+    fprintf(results, "{\"bench\":\"%s\",\"iters\":%ld,\"ops_per_sec\":%.1f,"
+	    "\"mean_us\":%.3f}\n", name, iters, iters / secs, secs / iters * 1e6);
+    fflush(results);
+}
+
+/* reportlat - Print the result of a latency benchmark, lat[] in seconds */
+static void reportlat(const char *name, double *lat, int n)
+{
+    double sum = 0;
+    int i;
+
+    qsort(lat, n, sizeof(double), cmpdouble);
+    for (i = 0; i < n; i++)
+	sum += lat[i];
+    fprintf(results, "{\"bench\":\"%s\",\"iters\":%d,\"mean_us\":%.1f,"
+	    "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n", name, n, 
+	    sum / n * 1e6, lat[n / 2] * 1e6, lat[n * 99 / 100] * 1e6, 
+	    lat[n - 1] * 1e6);
+    fflush(results);
+}
+
+/* startone - Start cmdline as a job in the given state */
+static pid_t startone(char *cmdline, int state)
+{
+    static struct lexer_t lx;
+    static struct pipeline_t pl;
+    int tok = 0;
+    pid_t pid;
+
+    if (lexline(&lx, cmdline, strlen(cmdline)) <= 0 || 
+	!nextpipeline(&lx, &tok, &pl) ||
+	(pid = startjob(&pl, state, cmdline)) == 0)
+	app_error("cannot start benchmark job");
+    return pid;
+}
+
+/* reap - Run the event loop until the job pid is gone */
+static void reap(pid_t pid)
+{
+    while (getjobpid(jobs, pid) != NULL)
+	evwait(-1);
+}
+
+/* launchloop - Run /bin/true through eval n times with the given launcher */
+static void launchloop(const char *name, long n, int fork, int zygote)
+{
+    double t;
+    long i;
+
+    use_fork = fork;
+    zygfd = zygote ? zygsock : -1;
+    eval("/bin/true\n");    /* warm up the command cache */
+    t = now();
+    for (i = 0; i < n; i++)
+	eval("/bin/true\n");
+    report(name, n, now() - t);
+    use_fork = 0;
+    zygfd = -1;
+}
+
+/* 
+ * bench_launch - Foreground /bin/true through eval: parse, spawn,
+ *    wait for SIGCHLD, reap and delete the job. Each launcher is timed
+ *    with the shell at its normal size, and again after the shell has
+ *    grown by 256 MB.
+ */
+static void bench_launch(void)
+{
+    long n = 2000 * scale;
+    size_t big = 256 << 20;
+    char *mem;
+
+    launchloop("launch", n, 0, 0);
+    launchloop("launch_fork", n, 1, 0);
+    launchloop("launch_zygote", n, 0, 1);
+
+    if ((mem = malloc(big)) == NULL)
+	unix_error("malloc error");
+    memset(mem, 1, big);
+    launchloop("launch_rss256", n, 0, 0);
+    launchloop("launch_fork_rss256", n, 1, 0);
+    launchloop("launch_zygote_rss256", n, 0, 1);
+    free(mem);
+}
+
+/* 
+ * bench_reap - Time from the exit of a child to the removal of its job
+ *    by sigchld_handler. waitid(WNOWAIT) tells when the child has
+ *    exited without reaping it.
+ */
+static void bench_reap(void)
+{
+    int i, n = 500 * scale;
+    double *lat = malloc(n * sizeof(double));
+    siginfo_t si;
+    pid_t pid;
+
+    for (i = 0; i < n; i++) {
+	pid = startone("/bin/true &\n", BG);
+	if (waitid(P_PID, pid, &si, WEXITED|WNOWAIT) < 0)
+	    unix_error("waitid error");
+	lat[i] = now();
+	reap(pid);
+	lat[i] = now() - lat[i];
+    }
+    reportlat("reap", lat, n);
+    free(lat);
+}
+
+/* 
+ * bench_signal - Time from a SIGINT or SIGTSTP sent to the shell to
+ *    the state change of its foreground job: the signal is read by the
+ *    event loop, forwarded by sigint_handler or sigtstp_handler, and
+ *    the job is deleted or marked stopped by sigchld_handler
+ */
+static void bench_signal(int sig)
+{
+    int i, n = 200 * scale;
+    double *lat = malloc(n * sizeof(double));
+    struct job_t *job;
+    pid_t pid;
+
+    for (i = 0; i < n; i++) {
+	pid = startone("sleep 100\n", FG);
+	usleep(1000);       /* let the child reach its exec */
+	lat[i] = now();
+	kill(getpid(), sig);
+	waitfg(pid);
+	lat[i] = now() - lat[i];
+	if ((job = getjobpid(jobs, pid)) != NULL) {
+	    kill(-pid, SIGKILL);
+	    kill(-pid, SIGCONT);
+	    reap(pid);
+	}
+    }
+    reportlat(sig == SIGINT ? "sigint" : "sigtstp", lat, n);
+    free(lat);
+}
+
+static void bench_sigint(void) { bench_signal(SIGINT); }
+static void bench_sigtstp(void) { bench_signal(SIGTSTP); }
+
+/* bench_lexer - lexline on a typical and on a long command line */
+static void bench_lexer(void)
+{
+    static struct lexer_t lx;
+    char *line = "/usr/bin/grep -n 'a b' \"$x\" file1 file2 | sort -u > out &\n";
+    char *big;
+    long i, n = 1000000 * scale;
+    size_t len = strlen(line);
+    double t;
+
+    t = now();
+    for (i = 0; i < n; i++)
+	lexline(&lx, line, len);
+    report("lexline", n, now() - t);
+
+    if ((big = malloc(100 * len + 1)) == NULL)
+	unix_error("malloc error");
+    for (i = 0; i < 100; i++)
+	memcpy(big + i * (len - 3), line, len - 3);
+    big[100 * (len - 3)] = '\0';
+    len = strlen(big);
+    n = 20000 * scale;
+    t = now();
+    for (i = 0; i < n; i++)
+	lexline(&lx, big, len);
+    report("lexline_long", n, now() - t);
+    free(big);
+}
+
+/* unlinkcache - Remove the files of the cache directory dir */
+static void unlinkcache(const char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *d;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+	return;
+    while ((d = readdir(dp)) != NULL)
+	if (d->d_name[0] != '.') {
+	    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+	    unlink(path);
+	}
+    closedir(dp);
+}
+
+/* 
+ * bench_script - Time to load a 5000-line script and get the tokens
+ *    of every line: lexing it (no -C), on a cache miss (lexing it and
+ *    writing the image) and on a cache hit (mapping the image)
+ */
+static void bench_script(void)
+{
+    static const char *lines[] = {
+	"/usr/bin/grep -n 'a b' \"$x\" file1 file2 | sort -u &\n",
+	"echo building target one; make -C src/one all\n",
+	"printf '%s\\n' \"a \\\"quoted\\\" word\" | /bin/cat\n",
+	"/bin/sleep 0 &\n",
+	"\n",
+    };
+    char dir[] = "/tmp/tshbenchXXXXXX", path[64], cache[64];
+    int i, n = 50 * scale, nlines = 5000;
+    struct lexer_t lx;
+    uint32_t k;
+    FILE *f;
+    double t;
+
+    if (mkdtemp(dir) == NULL)
+	unix_error("mkdtemp error");
+    snprintf(path, sizeof(path), "%s/script", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    if ((f = fopen(path, "w")) == NULL || mkdir(cache, 0755) < 0)
+	unix_error("cannot create the script");
+    for (i = 0; i < nlines; i++)
+	fputs(lines[i % 5], f);
+    fclose(f);
+
+    memset(&lx, 0, sizeof(lx));
+    t = now();
+    for (i = 0; i < n; i++) {
+	scriptopen(path, NULL);
+	for (k = 0; k < script.nlines; k++)
+	    scriptlexer(k, &lx);
+	scriptclose();
+    }
+    report("script_nocache", n, now() - t);
+
+    t = now();
+    for (i = 0; i < n; i++) {
+	scriptopen(path, cache);
+	for (k = 0; k < script.nlines; k++)
+	    scriptlexer(k, &lx);
+	scriptclose();
+	unlinkcache(cache);
+    }
+    report("script_cache_miss", n, now() - t);
+
+    scriptopen(path, cache);
+    scriptclose();
+    t = now();
+    for (i = 0; i < n; i++) {
+	scriptopen(path, cache);
+	for (k = 0; k < script.nlines; k++)
+	    scriptlexer(k, &lx);
+	scriptclose();
+    }
+    report("script_cache_hit", n, now() - t);
+
+    unlinkcache(cache);
+    rmdir(cache);
+    unlink(path);
+    rmdir(dir);
+}
+
+/* 
+ * bench_jobs - addjob, getjobpid, getjobjid and deletejob on a table
+ *    of 1000 jobs with made-up PIDs (no processes are started)
+ */
+static void bench_jobs(void)
+{
+    int i, r, rounds = 200 * scale, n = 1000;
+    pid_t base = 1 << 22;   /* above pid_max, no real process */
+    volatile long sink = 0;
+    double tadd = 0, tpid = 0, tjid = 0, tdel = 0, t;
+
+    for (r = 0; r < rounds; r++) {
+	t = now();
+	for (i = 0; i < n; i++)
+	    addjob(jobs, base + i, BG, "sleep 1 &\n");
+	tadd += now() - t;
+	t = now();
+	for (i = 0; i < n; i++)
+	    sink += getjobpid(jobs, base + (i * 7919) % n)->jid;
+	tpid += now() - t;
+	t = now();
+	for (i = 1; i <= n; i++)
+	    sink += getjobjid(jobs, i)->pid;
+	tjid += now() - t;
+	t = now();
+	for (i = 0; i < n; i++)
+	    deletejob(jobs, base + i);
+	tdel += now() - t;
+    }
+    report("addjob", (long)rounds * n, tadd);
+    report("getjobpid", (long)rounds * n, tpid);
+    report("getjobjid", (long)rounds * n, tjid);
+    report("deletejob", (long)rounds * n, tdel);
+}
+
+struct {
+    char *name;
+    void (*run)(void);
+} benches[] = {
+    { "launch", bench_launch },
+    { "reap", bench_reap },
+    { "sigint", bench_sigint },
+    { "sigtstp", bench_sigtstp },
+    { "lexer", bench_lexer },
+    { "script", bench_script },
+    { "jobs", bench_jobs },
+};
+#define NBENCH (int)(sizeof(benches) / sizeof(benches[0]))
+
+int main(int argc, char **argv)
+{
+    int c, i, j, fd;
+
+    while ((c = getopt(argc, argv, "n:")) != EOF) {
+	if (c != 'n' || (scale = atoi(optarg)) < 1) {
+	    fprintf(stderr, "usage: tshbench [-n scale] [benchmark ...]\n");
+	    exit(1);
+	}
+    }
+
+    /* results go to the real stdout, the shell's own output to /dev/null */
+    if ((fd = dup(STDOUT_FILENO)) < 0 || (results = fdopen(fd, "w")) == NULL ||
+	(fd = open("/dev/null", O_RDWR)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+	unix_error("cannot set up output");
+    initvars();
+    zygstart();
+    zygsock = zygfd;
+    zygfd = -1;
+    initevents(fd);
+    initjobs(jobs);
+
+    for (i = 0; i < NBENCH; i++) {
+	if (optind < argc) {
+	    for (j = optind; j < argc && strcmp(argv[j], benches[i].name); j++)
+		;
+	    if (j == argc)
+		continue;
+	}
+	benches[i].run();
+    }
+    return 0;
+}
@@ -3,6 +3,7 @@
  * 
  * <Zarana Parekh 201301177@daiict.ac.in>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,26 +13,60 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <dirent.h>
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
-#define MAXJID    1<<16   /* max job ID */
+#define MAXJOBS      16   /* initial size of the job table */
+#define MAXJID  (1<<16)   /* max job ID */
+#define CMDHASHSIZE 256   /* buckets in the command location cache */
+#define MAXEVENTS    64   /* epoll events handled per wakeup */
+#define VARHASHSIZE 256   /* buckets in the variable table */
+#define VARMARK  '\001'   /* the lexer's mark for a $ to expand */
+#define VARQMARK '\002'   /* the same, for a $ in double quotes */
+#define VARMARKS "\001\002" /* both, for strpbrk */
+#define CAPTUREMAX (64<<20) /* bytes in all output rings (-O) */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued, waiting for admission */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     QU (queued)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QU -> BG  : admitted by the scheduler
+ *     QU -> FG  : fg command
+ *     QU -> BG  : bg command
  * At most 1 job can be in the FG state.
  */
 
@@ -39,49 +74,578 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int use_fork = 0;           /* if true, launch jobs with fork+execve */
+int driver = 0;             /* if true, buffer output for a driver (-d) */
+int zygfd = -1;             /* socket to the fork server (-z), -1 if none */
+int laststatus = 0;         /* exit status of the last command */
+int asyncsig = 0;           /* if true, use signal handlers, not a signalfd */
+volatile sig_atomic_t fgpgid = 0;      /* process group of the foreground job */
+volatile sig_atomic_t interrupted = 0; /* ctrl-c was typed with no foreground job */
+int listabort = 0;          /* ctrl-c killed a job: skip the rest of the line */
+pid_t jobpgid = 0;          /* in a subshell, its process group, for its jobs */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct jobusage_t {         /* resources used by a job */
+    struct timespec start;  /* when the job was started (CLOCK_MONOTONIC) */
+    struct timespec end;    /* when its last process was reaped */
+    struct timeval utime;   /* user CPU time of its reaped processes */
+    struct timeval stime;   /* system CPU time of its reaped processes */
+    long maxrss;            /* largest resident set of a process (KB) */
+    long nvcsw, nivcsw;     /* voluntary and involuntary context switches */
+    long minflt, majflt;    /* minor and major page faults */
+};
+
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (also its process group ID) */
     int jid;                /* job ID [1, 2, ...] */
-    int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int state;              /* UNDEF, BG, FG, ST or QU */
+    int nextfree;           /* next slot on the free list (unused slots) */
+    pid_t *pids;            /* PIDs of all processes of a pipeline */
+    int npids;              /* number of processes in pids */
+    int nlive;              /* processes not reaped yet */
+    int pidcap;             /* allocated size of pids (kept across jobs) */
+    int status;             /* wait status of the last process */
+    struct jobusage_t usage;/* resources used so far */
+    char *cmdline;          /* command line, interned in cmdpool */
+    size_t cmdlen;          /* its length */
+    int prio;               /* priority in the queue (a nice value) */
+    unsigned int seq;       /* order of arrival in the queue */
+    char *runline;          /* queued: its words expanded and quoted */
+    int place;              /* its entry in pin.load, -1 if not placed */
+    char cpus[24];          /* CPUs it is pinned to (a cpulist), "" if none */
+};
+
+struct pident_t {           /* PID index entry */
+    pid_t pid;              /* 0 if empty, -1 if deleted */
+    int slot;               /* slot of the job owning pid */
+};
+
+/*
+ * The job table grows on demand. Jobs live in slots[]; unused slots are
+ * chained on a free list so that addjob does not have to scan. Two
+ * indexes make lookups constant-time: an open-addressed hash from the
+ * PID of every process of a job to its slot, and a direct map from JID
+ * to slot. Only the shell's main flow touches the table: children are
+ * reaped into the reaped ring (see sigchld_handler), and reapdrain
+ * updates the jobs from the event loop, never in signal context. So
+ * addjob may grow the arrays and jobs are deleted without any locking;
+ * a job_t pointer is only good until the next addjob.
+ */
+struct jobtable_t {
+    struct job_t *slots;    /* job slots */
+    int nslots;             /* number of allocated slots */
+    int njobs;              /* number of slots in use */
+    int freeslot;           /* head of the free slot list, -1 if none */
+    struct pident_t *pidtab;/* PID -> slot hash (open addressing) */
+    int pidmask;            /* size of pidtab - 1 */
+    int pidused;            /* live plus deleted entries in pidtab */
+    int pidlive;            /* live entries in pidtab */
+    int *jidtab;            /* JID -> slot+1, 0 if the JID is unused */
+    int jidcap;             /* number of entries in jidtab */
+    int maxjid;             /* largest allocated JID */
+    int nrunning;           /* jobs in the BG state */
+    int fgslot;             /* slot of the job in the FG state, -1 if none */
+};
+struct jobtable_t jobtable;          /* The job list */
+struct jobtable_t *jobs = &jobtable;
+struct jobusage_t fgusage;  /* usage of the last foreground job to finish */
+
+#define DONESIZE 256        /* finished background jobs kept for wait */
+struct donejob_t {          /* a background job that finished */
+    pid_t pid;              /* its process group */
+    int jid;
+    int status;             /* wait status of its last process */
+};
+struct donetab_t {          /* ring of the last DONESIZE finished jobs */
+    struct donejob_t recs[DONESIZE];
+    unsigned int count;     /* jobs recorded so far */
+    unsigned int waited;    /* jobs before this one were taken by wait */
+};
+struct donetab_t donetab;
+
+/*
+ * Job command lines live in a string pool. Identical lines share one
+ * copy, and the copies are packed into large chunks that are released
+ * as a whole once none of their lines is used by a job any more.
+ */
+#define STRCHUNK (16*1024)  /* default size of a pool chunk */
+struct strchunk_t {         /* a chunk of the command line pool */
+    int live;               /* strings in use in this chunk */
+    size_t size, used;      /* bytes in data, bytes handed out */
+    char data[];            /* strings, aligned like size_t */
+};
+struct cmdstr_t {           /* an interned command line */
+    struct cmdstr_t *next;  /* hash chain */
+    struct strchunk_t *chunk; /* chunk holding it */
+    unsigned int hash;      /* hash of text */
+    int refs;               /* jobs using it */
+    size_t len;             /* length of text */
+    char text[];            /* the line, ending in a newline */
+};
+struct strpool_t {
+    struct strchunk_t *cur; /* chunk new strings are put in */
+    struct cmdstr_t **tab;  /* text -> string (chained hash) */
+    int mask;               /* size of tab - 1 */
+    int count;              /* strings in the pool */
+};
+struct strpool_t cmdpool;   /* the command lines of the jobs */
+
+/* Events recorded by the tracer (-T) */
+#define TR_READ  0  /* a command line was read */
+#define TR_PARSE 1  /* it was split into tokens (status: their number) */
+#define TR_FORK  2  /* a process is about to be created */
+#define TR_EXEC  3  /* it has been created and runs its command */
+#define TR_ADD   4  /* a job was added to the job list */
+#define TR_STOP  5  /* a job was stopped (status: the wait status) */
+#define TR_CONT  6  /* a job was continued by fg or bg */
+#define TR_EXIT  7  /* a process was reaped (status: the wait status) */
+#define TR_REAP  8  /* a job was deleted from the job list */
+#define TRACESIZE 4096      /* records buffered before a write */
+struct trace_t {            /* a trace record */
+    struct timespec ts;     /* when (CLOCK_MONOTONIC) */
+    int event;              /* TR_* */
+    pid_t pid;
+    int jid;
+    int status;
+};
+struct tracebuf_t {         /* records not written out yet */
+    struct trace_t *recs;   /* preallocated, TRACESIZE records */
+    int count;
+    int fd;                 /* trace file, -1 if not tracing */
+};
+struct tracebuf_t tracebuf = { NULL, 0, -1 };
+
+struct builtin_t {          /* a builtin command */
+    const char *name;
+    int (*fn)(char **argv); /* runs it, returns its exit status */
+    int inshell;            /* acts on the shell, never forked on its own */
+};
+
+struct cmdhash_t {          /* command location cache entry */
+    char *name;             /* command name as typed */
+    char *path;             /* where PATH search found it */
+    int hits;               /* times the cached path was used */
+    struct cmdhash_t *next; /* next entry in the bucket */
+};
+
+struct var_t {              /* a shell variable */
+    char *entry;            /* NAME=value */
+    size_t namelen;
+    int exported;           /* given to commands */
+    int slot;               /* its slot in env.envp, -1 if none */
+    struct var_t *next;     /* next in the hash chain */
+};
+struct var_t *vartab[VARHASHSIZE];
+
+struct envsave_t {          /* a slot of env.envp an assignment took over */
+    int slot;
+    char *entry;
+};
+struct env_t {              /* the environment given to commands */
+    char **base;            /* spare slots, then envp */
+    char **envp;            /* the exported variables, NULL-terminated */
+    int spare;              /* slots in front of envp */
+    int stale;              /* a variable was exported or unset since */
+    struct envsave_t *saved; /* the slots envlayer took over */
+    int nsaved, savedcap;
+};
+struct env_t env;
+
+struct {                    /* the words varexpand returned */
+    char **strs;
+    int n, cap;
+} expanded;
+struct cmdhash_t *cmdhash[CMDHASHSIZE]; /* command name -> path */
+char *cmdhashpath;          /* PATH value the cache was filled for */
+
+struct evsrc_t;
+typedef void evhandler_t(struct evsrc_t *src, unsigned int events);
+struct evsrc_t {            /* a file descriptor watched by the event loop */
+    int fd;                 /* the descriptor */
+    evhandler_t *handler;   /* called when epoll reports events on fd */
+};
+int epfd = -1;              /* epoll instance of the event loop */
+struct evsrc_t sigsrc;      /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+sigset_t origmask;          /* signal mask to hand to children */
+
+int wakefd = -1;            /* signal handlers wake the event loop (-a) */
+
+#define REAPRING 256        /* records in the reaped ring, a power of 2 */
+struct reaprec_t {          /* a child reaped by sigchld_handler */
+    pid_t pid;
+    int status;             /* its wait status */
+    struct rusage ru;       /* resources it used */
+    struct timespec ts;     /* when it was reaped */
+};
+struct reapring_t {         /* reaped children not handled yet */
+    struct reaprec_t recs[REAPRING];
+    atomic_uint head;       /* next record to fill (sigchld_handler) */
+    atomic_uint tail;       /* next record to handle (reapdrain) */
+    volatile sig_atomic_t overflow; /* children were left unreaped */
+};
+struct reapring_t reapring;
+
+struct sched_t {            /* the admission queue */
+    int maxrun;             /* background jobs running at once, 0: no limit */
+    double maxload;         /* 1-minute load average, 0: no limit */
+    long minmem;            /* memory available (MB), 0: no limit */
+    int *heap;              /* job slots of the queued jobs */
+    int nqueued, heapcap;
+    unsigned int seq;       /* jobs queued so far */
+    struct evsrc_t timer;   /* timerfd that polls the load and the memory */
+};
+struct sched_t sched = { .timer = { .fd = -1 } };
+
+struct scriptline_t {
+    uint32_t text;          /* offset of the line in text */
+    uint32_t tok;           /* index of its first token */
+    int32_t ntok;           /* its tokens, -1 to lex the text when run */
+    int32_t njobs;          /* its jobs */
+};
+
+struct script_t {           /* the script being run */
+    char *image;            /* the image, mapped or in memory */
+    size_t len;
+    int mapped;             /* image is a mapping of the cache file */
+    struct scriptline_t *lines;
+    size_t *offs;
+    int *types;
+    uint32_t *words;
+    char *text;
+    uint32_t nlines;
+    char **argv;            /* argv of the line being run */
+    int argvcap;
+};
+struct script_t script;
+
+struct input_t {            /* buffered standard input */
+    struct evsrc_t src;     /* stdin as an event source */
+    char *buf;              /* unread input is buf[pos..len) */
+    size_t pos, len, cap;
+    size_t scan;            /* buf[pos..scan) has no newline */
+    char saved;             /* byte overwritten by the last line's NUL */
+    int eof;                /* read() returned end of file */
+    int pollable;           /* stdin can be watched by epoll */
+    int ready;              /* epoll reported stdin readable */
+};
+struct input_t input;
+
+struct history_t {          /* the command history, shared by all shells */
+    int fd, idxfd;          /* the history and its index, -1 if none */
+    char *text;             /* the history, mapped */
+    size_t textlen;
+    uint64_t *idx;          /* offset of each entry in text, mapped */
+    size_t idxlen;          /* bytes of the index mapped */
+    size_t n;               /* entries in the mapped text */
+};
+struct history_t hist = { .fd = -1, .idxfd = -1 };
+
+struct editor_t {           /* the line editor */
+    int on;                 /* stdin is a terminal and lines are edited */
+    struct termios cooked;  /* the terminal settings to restore */
+    char *buf;              /* the line is buf[0..len), cursor at pos */
+    size_t len, pos, cap;
+    char *saved;            /* the line typed before browsing the history */
+    size_t savedlen, savedcap;
+    int browsing;           /* up and down are recalling entries */
+    size_t hpos;            /* entry recalled, hist.n for the typed line */
+    size_t plen;            /* prefix the recalled entries start with */
+    int searching;          /* in a reverse incremental search (ctrl-r) */
+    int failed;             /* the search found nothing */
+    char query[256];
+    size_t qlen;
+    size_t match;           /* entry the search found, hist.n if none */
+    int esc, escarg;        /* escape sequence being read */
+    unsigned char in[256];  /* typed ahead, in[inpos..inlen) */
+    int inpos, inlen;
+    char *out;              /* the redrawn line */
+    size_t outlen, outcap;
+};
+struct editor_t ed;
+
+struct ctlclient_t {        /* a client of the control socket (-S) */
+    struct evsrc_t src;     /* its connection */
+    char *in;               /* requests read, in[0..inlen) */
+    size_t inlen, incap;
+    char *out;              /* replies not written yet */
+    size_t outlen, outcap;
+    int eof;                /* the client has sent everything */
+    int dead;               /* the connection failed or lagged too far */
+    int busy;               /* its requests are being carried out */
+    int subscribed;         /* it gets the job events */
+    struct ctlclient_t *next;
+};
+struct ctl_t {              /* the control socket */
+    struct evsrc_t src;     /* listening socket, fd -1 if none */
+    char *path;
+    pid_t owner;            /* the shell that removes it at exit */
+    struct ctlclient_t *clients;
+    int nsubs;              /* clients subscribed to job events */
+};
+struct ctl_t ctl = { .src = { .fd = -1 } };
+
+struct capture_t {          /* the output of a background job (-O) */
+    struct evsrc_t src;     /* read end of the pipe it writes to */
+    char *ring;             /* the last capture.size bytes it wrote */
+    uint64_t head;          /* bytes it wrote so far */
+    int jid;
+    pid_t pgid;
+    int open;               /* the pipe is not at end of file yet */
+    int follow;             /* output -f is showing it */
+    struct capture_t *next; /* next older ring */
+};
+struct capturetab_t {       /* the rings */
+    size_t size;            /* bytes in each ring, 0 if not capturing */
+    size_t total;           /* bytes in all rings */
+    int stdoutfd;           /* the shell's real standard output */
+    int stdoutpipe;         /* it is a pipe, so tee(2) can copy to it */
+    struct capture_t *rings; /* newest first */
+};
+struct capturetab_t capture = { .stdoutfd = -1 };
+
+/* Placement policies for background jobs (pin -p) */
+#define PIN_OFF   0 /* they run on the CPUs of the shell */
+#define PIN_RR    1 /* each on the next CPU in turn */
+#define PIN_LEAST 2 /* each on the CPU with the fewest placed jobs */
+#define PIN_NODE  3 /* each on the NUMA node with the fewest placed jobs */
+struct pintab_t {           /* the CPUs background jobs are placed on */
+    int policy;             /* PIN_* */
+    int ready;              /* the topology below has been read */
+    cpu_set_t shellset;     /* CPUs the shell may run on */
+    int *cpus;              /* the CPUs of shellset, in order */
+    int ncpus;
+    cpu_set_t *nodes;       /* CPUs of each NUMA node, within shellset */
+    int nnodes;
+    int next;               /* where the next search starts */
+    int *load;              /* placed jobs on cpus[i], then on nodes[n] */
+};
+struct pintab_t pin;
+
+struct batchline_t {        /* a line of a batch script (-j) in flight */
+    struct evsrc_t src;     /* read end of the pipe its output goes to */
+    pid_t pgid;             /* its job, 0 if none was started */
+    int done;               /* the job finished (or never started) */
+    int killed;             /* it stopped, so the shell killed it */
+    int status;             /* its exit status, as $? would be */
+    int open;               /* the pipe is not at end of file yet */
+    char *out;              /* output captured so far */
+    size_t len, cap;
+};
+struct batch_t {            /* the batch scheduler */
+    struct batchline_t *lines; /* window of lines, oldest at head */
+    int size;               /* window size */
+    int head, count;        /* first line and number of lines in window */
+    int maxrun;             /* max jobs running at once, 0 if not batch */
+    int running;            /* jobs running */
+    int status;             /* first nonzero status of a line, in order */
+    int stdoutfd;           /* the shell's real standard output */
+};
+struct batch_t batch;
+
+/* Token types of the command line lexer */
+#define T_WORD 0    /* a word, argv[] points to its text */
+#define T_PIPE 1    /* | */
+#define T_AMP  2    /* & */
+#define T_SEMI 3    /* ; */
+#define T_AND  4    /* && */
+#define T_OR   5    /* || */
+#define T_LBRACE 6  /* { starting a command */
+#define T_RBRACE 7  /* } ending a group */
+#define T_REDIR 8   /* a redirection: T_REDIR | op << 4 | fd << 8 */
+#define REDIROP(t) ((t) >> 4 & 15)
+#define REDIRFD(t) ((t) >> 8)
+#define ISREDIR(t) (((t) & 15) == T_REDIR)
+#define R_IN     0  /* < file */
+#define R_OUT    1  /* > file */
+#define R_APPEND 2  /* >> file */
+#define R_DUP    3  /* >& n, <& n: a copy of descriptor n, - to close it */
+#define R_HERE   4  /* <<< word: the word and a newline */
+
+struct lexer_t {            /* the tokens of a command line */
+    char *buf;              /* the words, each terminated by a NUL */
+    size_t bufcap;
+    char **argv;            /* word of each token, NULL at operators */
+    int *type;              /* type of each token */
+    size_t *off;            /* offset of each token in the line */
+    int ntok, tokcap;       /* number of tokens, room for tokens */
+    int njobs;              /* number of jobs on the line */
+    const char *line;       /* the line */
+    int quiet;              /* do not report syntax errors */
+};
+struct group_t {            /* a stage run by a subshell */
+    char *argv[2];          /* its argv in cmds: groupword */
+    struct lexer_t *lx;     /* it runs tokens start..end-1 of lx */
+    int start, end;
+};
+struct redir_t {            /* a redirection of a stage */
+    int stage;
+    int fd;                 /* the descriptor redirected */
+    int op;                 /* R_* */
+    char *word;             /* the file, descriptor or string */
+    int src;                /* what fd becomes, -1: closed (redirsetup) */
+    int saved;              /* fd before the redirection, in the shell */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct pipeline_t {         /* a job of a command line */
+    char ***cmds;           /* argv of each stage */
+    int ncmds, cmdcap;
+    char **words;           /* argv of the stages with redirections */
+    int wordcap;
+    struct redir_t *redirs; /* the redirections, stage by stage */
+    int nredirs, redircap;
+    int bg;                 /* run in the background */
+    int list;               /* an and-or list or a group, not a pipeline */
+    int start, end;         /* its tokens */
+    struct group_t *groups; /* the stages run by subshells */
+    int ngroups, groupcap;
+    const char *text;       /* text of the job in the line */
+    size_t textlen;
+};
+char groupword[] = "{";     /* argv[0] of a stage run by a subshell */
 /* End global variables */
 
-int check_fg; /* to check if the process is in the foreground state. */
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
-int builtin_cmd(char **argv);
+void runlexed(struct lexer_t *lx, char *cmdline);
+void runlist(struct lexer_t *lx, int start, int end, char *cmdline);
+void runandor(struct lexer_t *lx, int start, int end);
+void runpipeline(struct pipeline_t *pl, char *cmdline);
+pid_t startjob(struct pipeline_t *pl, int state, char *cmdline);
+int builtin_cmd(char **argv, int bg, struct redir_t *r, int nr);
+struct builtin_t *findbuiltin(const char *name);
 void do_bgfg(char **argv);
+void do_hash(char **argv);
 void waitfg(pid_t pid);
+pid_t spawnjob(char **argv, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd);
+pid_t spawncmd(char **argv, char **envp, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd);
+pid_t spawngroup(struct group_t *g, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd);
 
 void sigchld_handler(int sig);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
+void reapdrain(void);
+static void reapchildren(void);
+static void jobreaped(struct reaprec_t *r);
+static struct reaprec_t *reapslot(void);
+static void reappush(void);
+static struct reaprec_t *reappeek(void);
+static void reappop(void);
+static void wakeup(void);
+void addusage(struct jobusage_t *usage, struct rusage *ru);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int lexline(struct lexer_t *lx, const char *cmdline, size_t len);
+int lexjob(struct lexer_t *lx, int i, int end, struct pipeline_t *pl);
+int nextpipeline(struct lexer_t *lx, int *tok, struct pipeline_t *pl);
+static int lexclose(struct lexer_t *lx, int i);
+int lexgroupend(struct lexer_t *lx, int i, int end);
+int redirsetup(struct redir_t *r, int n);
+void redirclose(struct redir_t *r, int n);
+void redirdup(struct redir_t *r, int n);
+int redirsave(struct redir_t *r, int n);
+void redirrestore(struct redir_t *r, int n);
+void lexredirs(struct pipeline_t *pl, struct lexer_t *lx, int i, int end, int stage);
+char *pipelinetext(struct pipeline_t *pl);
 void sigquit_handler(int sig);
 
+void initevents(int infd);
+void initsubshell(sigset_t *mask);
+void evwait(int timeout);
+char *readcmdline(void);
+
+void ctlopen(char *path);
+void ctlevent(int jid, pid_t pgid, int status);
+
+struct capture_t *capbegin(void);
+void capend(struct capture_t *c, pid_t pgid);
+struct capture_t *capfind(const char *arg);
+void capwrite(struct capture_t *c, uint64_t from, size_t n);
+
+void pininit(void);
+void pinset(int place, cpu_set_t *set);
+int pinbegin(void);
+void pinend(int place, pid_t pgid);
+int pinjob(struct job_t *job, cpu_set_t *set);
+int cpulistparse(const char *s, cpu_set_t *set);
+int cpulistread(const char *path, cpu_set_t *set);
+void cpulistfmt(cpu_set_t *set, char *buf, size_t size);
+
+void edinit(void);
+char *editline(const char *prompt);
+void histopen(void);
+void histadd(const char *line, size_t len);
+
+int runbatch(void);
+
+int scriptopen(char *path, char *cachedir);
+void scriptclose(void);
+int scriptlexer(uint32_t i, struct lexer_t *lx);
+void runscript(void);
+
+int schedfull(void);
+int schedqueue(struct pipeline_t *pl, char *cmdline, int prio);
+pid_t schedstart(struct job_t *job, int state);
+void schedcancel(struct job_t *job, int sig);
+void schedrun(void);
+int niceprefix(char ***argvp);
+void schednice(pid_t pgid, int prio);
+int batchdone(pid_t pgid, int status);
+int batchstopped(pid_t pgid, int status);
+
+void jobdone(pid_t pid, int jid, int status);
+
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct jobtable_t *jobs);
+int maxjid(struct jobtable_t *jobs); 
+int addjob(struct jobtable_t *jobs, pid_t pid, int state, char *cmdline);
+int addjobpid(struct jobtable_t *jobs, pid_t pgid, pid_t pid);
+int addqueued(struct jobtable_t *jobs, int prio, char *cmdline);
+int deletejob(struct jobtable_t *jobs, pid_t pid); 
+int deletejobjid(struct jobtable_t *jobs, int jid);
+int deletejobpid(struct jobtable_t *jobs, pid_t pid);
+pid_t fgpid(struct jobtable_t *jobs);
+void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state);
+struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct jobtable_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct jobtable_t *jobs, int lflag);
+void printusage(struct jobusage_t *usage);
+
+char *cmdintern(const char *text, size_t len, size_t *lenp);
+void cmdrelease(char *text);
+
+void zygstart(void);
+pid_t zygspawn(char *path, char **argv, char **envp, sigset_t *mask, pid_t pgid, int infd, int outfd);
+
+void traceopen(char *file);
+void trace(int event, pid_t pid, int jid, int status, struct timespec *ts);
+void traceflush(void);
+
+size_t varnamelen(const char *s);
+size_t isassign(const char *word);
+char *varget(const char *name);
+void varset(const char *name, size_t len, const char *value, int export);
+int varunset(const char *name);
+void initvars(void);
+char **envget(void);
+char **envlayer(char **assigns, int n);
+void envunlayer(void);
+char *varexpand(const char *word);
+void varexpandreset(void);
+void expandjob(struct pipeline_t *pl);
+int assignjob(struct pipeline_t *pl);
+void varexport(void);
+
+char *findcmd(char *name);
+int hashforget(char *name);
+void hashclear(void);
 
 void usage(void);
 void unix_error(char *msg);
+int fdhigh(int fd);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
@@ -92,15 +656,21 @@ handler_t *Signal(int signum, handler_t *handler);
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
     int emit_prompt = 1; /* emit prompt (default) */
+    int infd = STDIN_FILENO; /* where command lines are read from */
+    char *cachedir = NULL; /* where compiled scripts are kept (-C) */
+    char *ctlpath = NULL; /* control socket (-S) */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
+    /* The environment becomes the shell's exported variables */
+    initvars();
+
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {	
+    while ((c = getopt(argc, argv, "hvpdfzaj:T:C:S:O:")) != EOF) {	
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -111,41 +681,131 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'd':             /* driver mode: -p with buffered output */
+            emit_prompt = 0;
+            driver = 1;
+	    break;
+        case 'f':             /* launch jobs with fork instead of posix_spawn */
+            use_fork = 1;
+	    break;
+        case 'z':             /* launch jobs through a fork server */
+            zygfd = 0;
+	    break;
+        case 'a':             /* signal handlers instead of a signalfd */
+            asyncsig = 1;
+	    break;
+        case 'j':             /* run a script, N commands at a time */
+            if ((batch.maxrun = atoi(optarg)) < 1)
+		usage();
+	    break;
+        case 'T':             /* trace job events to a file */
+            traceopen(optarg);
+	    break;
+        case 'C':             /* cache compiled scripts in a directory */
+            cachedir = optarg;
+	    break;
+        case 'S':             /* take requests on a control socket */
+            ctlpath = optarg;
+	    break;
+        case 'O':             /* capture background output in rings */
+            if ((capture.size = atol(optarg) * 1024) <= 0 || capture.size > CAPTUREMAX)
+		usage();
+	    capture.size = (capture.size + 4095) & ~(size_t)4095;
+	    break;
 	default:
             usage();
 	}
     }
     
+    /* Start the fork server while the shell is still small */
+    if (zygfd == 0)
+	zygstart();
+
+    /* In driver mode the shell's own output is collected in a large
+     * buffer and only written out before a job is started or resumed
+     * (so that it comes before anything the job prints), after a job
+     * notification, before the shell blocks for more input, and at
+     * exit. The output is the same, in the same order, with far fewer
+     * write calls. */
+    if (driver && setvbuf(stdout, NULL, _IOFBF, 64 * 1024) != 0)
+	unix_error("setvbuf error");
+
     /* Install the signal handlers */
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* In batch mode the script is read from its own descriptor and the
+     * commands get /dev/null as standard input */
+    if (batch.maxrun) {
+	if (optind < argc)
+	    infd = fdhigh(open(argv[optind], O_RDONLY|O_CLOEXEC));
+	else
+	    infd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+	if (infd < 0)
+	    unix_error("cannot open script");
+	if ((c = open("/dev/null", O_RDONLY)) < 0 || dup2(c, STDIN_FILENO) < 0)
+	    unix_error("cannot open /dev/null");
+	close(c);
+    }
+
+    /* Otherwise a script is run line by line, like standard input */
+    else if (optind < argc && scriptopen(argv[optind], cachedir) < 0)
+	unix_error("cannot open script");
+
+    /* ctrl-c, ctrl-z and terminated or stopped children are read from
+     * a signalfd by the event loop, which calls sigint_handler,
+     * sigtstp_handler and sigchld_handler, or with -a these are
+     * installed as signal handlers (see initevents) */
+    initevents(infd);
+    if (ctlpath != NULL)
+	ctlopen(ctlpath);
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
     
     /* Initialize the job list */
     initjobs(jobs);
+
+    /* Edit the lines typed at a terminal, with the shared history */
+    if (emit_prompt && !batch.maxrun && script.image == NULL)
+	edinit();
+
+    /* Run a batch script and exit with its aggregate status */
+    if (batch.maxrun) {
+	c = runbatch();
+	fflush(stdout);
+	exit(c);
+    }
+    if (script.image != NULL) {
+	runscript();
+	fflush(stdout);
+	exit(0);
+    }
+
     /* Execute the shell's read/eval loop */
     while (1) {
+	/* Report jobs that finished or stopped since the last command */
+	evwait(0);
+
 	/* Read command line */
-	if (emit_prompt) {
-	    printf("%s", prompt);
-	    fflush(stdout);
+	if (ed.on)
+	    cmdline = editline(prompt);
+	else {
+	    if (emit_prompt) {
+		printf("%s", prompt);
+		fflush(stdout);
+	    }
+	    cmdline = readcmdline();
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	if (cmdline == NULL) { /* End of file (ctrl-d) */
 	    fflush(stdout);
+	    while (ctl.src.fd >= 0) /* only the control socket is left */
+		evwait(-1);
 	    exit(0);
 	}
 
 	/* Evaluate the command line */
 	eval(cmdline);
-	fflush(stdout);
-	fflush(stdout);
+	if (!driver)
+	    fflush(stdout);
     } 
     exit(0); /* control never reaches here */
 }
@@ -164,131 +824,456 @@ int main(int argc, char **argv)
 
 void eval(char *cmdline) 
 {
-	char *argv[MAXARGS]; /* argv stores the arguments of cmdline in an array */
-	int is_bg = parseline(cmdline,argv); /* parse cmdline and check if new job is FG or BG */
-	pid_t pid = 0;
-	sigset_t sSet; /* signal set */
+	static struct lexer_t lx; /* tokens of cmdline, reused from line to line */
 	
-	if(argv[0] == NULL) /* ignore empty lines */
+	/* split the line into tokens; ignore empty lines and syntax errors */
+	if(lexline(&lx,cmdline,strlen(cmdline)) <= 0)
 		return;
-		
-	int is_builtin_cmd = builtin_cmd(argv); /* checking if cmdline is a built-in command */
+	runlexed(&lx,cmdline);
+	return;
+}
+
+/*
+ * runlexed - Run the jobs of cmdline, already split into the tokens of lx
+ *    (by eval, or from the script cache)
+ */
+void runlexed(struct lexer_t *lx, char *cmdline)
+{
+	listabort = 0;
+	runlist(lx,0,lx->ntok,lx->njobs == 1 ? cmdline : NULL);
+	return;
+}
+
+/*
+ * runlist - Run the jobs in tokens start..end-1 of lx one after the
+ *    other. cmdline is the text of a line of a single job, or NULL.
+ */
+/*
+	A list, a && b || c, or a group, { a; b; }, run in the foreground is run by the shell itself, job by job, without forking a copy of the shell: each job is waited for in turn and its exit status decides whether the next one runs. In the background, or as a stage of a pipeline, it is a single job run by a subshell (spawngroup), so that jobs, fg, bg, ctrl-c and ctrl-z act on the whole list.
+	
+	A job killed by ctrl-c ends the line, as the user meant to stop it rather than the one job.
+*/
+void runlist(struct lexer_t *lx, int start, int end, char *cmdline)
+{
+	struct pipeline_t pl = { 0 }; /* the job being run; lists nest */
+	int tok = start; /* next token to run */
+	
+	while(tok < end && !listabort) {
+		tok = lexjob(lx,tok,end,&pl);
+		if(pl.list && !pl.bg)
+			runandor(lx,pl.start,pl.end);
+		else
+			runpipeline(&pl,cmdline != NULL ? cmdline : pipelinetext(&pl));
+	}
+	free(pl.cmds);
+	free(pl.groups);
+	free(pl.words);
+	free(pl.redirs);
+	return;
+}
+
+/*
+ * runandor - Run the and-or list in tokens start..end-1 of lx: each
+ *    pipeline after a && runs if the one before succeeded, after a || if
+ *    it failed
+ */
+void runandor(struct lexer_t *lx, int start, int end)
+{
+	struct pipeline_t pl = { 0 };
+	int i, k, c, depth, run = 1;
+	
+	for(i = start; i < end && !listabort; i = k + 1) {
+		/* the pipeline ends at the next && or || outside a group */
+		for(k = i, depth = 0; k < end; k++) {
+			if(lx->type[k] == T_LBRACE)
+				depth++;
+			else if(lx->type[k] == T_RBRACE)
+				depth--;
+			else if(depth == 0 && (lx->type[k] == T_AND || lx->type[k] == T_OR))
+				break;
+		}
+		if(!run)
+			;
+		else if((c = lexgroupend(lx,i,k)) >= 0) { /* a group: no subshell, and its redirections are made by the shell */
+			pl.ncmds = pl.nredirs = 0;
+			lexredirs(&pl,lx,c + 1,k,0);
+			expandjob(&pl);
+			if(redirsave(pl.redirs,pl.nredirs) < 0)
+				laststatus = 1;
+			else {
+				runlist(lx,i + 1,c,NULL);
+				redirrestore(pl.redirs,pl.nredirs);
+			}
+		}
+		else {
+			lexjob(lx,i,k,&pl);
+			runpipeline(&pl,pipelinetext(&pl));
+		}
+		if(k < end) /* a skipped pipeline leaves the status as it is */
+			run = lx->type[k] == T_AND ? laststatus == 0 : laststatus != 0;
+	}
+	free(pl.cmds);
+	free(pl.groups);
+	free(pl.words);
+	free(pl.redirs);
+	return;
+}
+
+/*
+ * runpipeline - Run one job of a command line: a builtin, or a pipeline
+ *    started in the foreground or the background. cmdline is the text
+ *    of the job as shown by jobs.
+ */
+void runpipeline(struct pipeline_t *pl, char *cmdline)
+{
+	char **argv;
+	int timed = 0; /* the job has the time prefix */
+	int prio; /* priority given by the nice prefix */
+	struct timespec start;
+	pid_t pgid;
+	int i, jid;
+	
+	/* expand the variables; a job of assignments only sets them */
+	expandjob(pl);
+	if(assignjob(pl))
+		return;
+	argv = pl->cmds[0];
+	
+	/* time is a prefix: run the rest of the job and report what it used */
+	if(argv[0] != NULL && !strcmp(argv[0],"time")) {
+		timed = 1;
+		argv = ++pl->cmds[0];
+		memset(&fgusage,0,sizeof(fgusage));
+		clock_gettime(CLOCK_MONOTONIC,&start);
+	}
+	/* so is nice: it sets the priority of the job */
+	prio = niceprefix(&pl->cmds[0]);
+	argv = pl->cmds[0];
+	
+	/* a builtin run by the shell does not see assignments in front of it */
+	for(i = 0; argv[i] != NULL && isassign(argv[i]); i++)
+		;
+	if(pl->ncmds == 1 && builtin_cmd(argv + i,pl->bg,pl->redirs,pl->nredirs)) /* checking if cmdline is a built-in command */
+		pgid = 0;
+	else if(argv[0] == NULL)
+		pgid = 0;
+	
+	/*
+		A background job that would go over the limits set with sched waits in the queue, and is started by the scheduler when a job finishes.
+	*/
+	else if(pl->bg && !timed && schedfull()) {
+		pgid = 0;
+		if((jid = schedqueue(pl,cmdline,prio)) != 0)
+			printf("[%d] Queued %s",jid,cmdline);
+		laststatus = jid != 0 ? 0 : 1;
+	}
 	
 	/* 
-	Executing commands which are not built-in requires a new child process to be created using fork and executing the corresponding command using execve() function. 
+	Executing commands which are not built-in requires new child processes, which startjob() creates and adds to the job list.
+	*/
+	else if((pgid = startjob(pl,pl->bg ? BG : FG,cmdline)) == 0)
+		laststatus = 127;
+	else if(schednice(pgid,prio), !pl->bg) { 
+	/*
+		If the job is a foreground job, waitfg is called to ensure that there is only one job running in the foreground.
+	*/
+		waitfg(pgid); /* ensuring only 1 foreground process is there */
+	} else {
+	/*
+		There can be multible jobs running in the background. Hence, we do have to wait for the job to terminate before adding another background job.
+	*/
+		printf("[%d] (%d) %s", pid2jid(pgid),pgid,cmdline); 
+		laststatus = 0;
+	}
 	
-	The signal SIGCHLD is blocked before adding a new job to the job list and unblocked later. This is done to ensure correct sequence of execution and that there is no race condition while adding or deleting a job which are the critical section of the code.
+	/*
+		If the timed job ran in the foreground and finished, sigchld_handler has left its usage in fgusage; otherwise (a builtin, a background or stopped job) only the elapsed time is known.
+	*/
+	if(timed) {
+		if(fgusage.end.tv_sec == 0 && fgusage.end.tv_nsec == 0) {
+			fgusage.start = start;
+			clock_gettime(CLOCK_MONOTONIC,&fgusage.end);
+		}
+		printusage(&fgusage);
+	}
+	return;
+}
+
+/*
+ * startjob - Start the stages of pipeline pl, with their redirections,
+ *    and add it to the job list in the given state. Returns the job's
+ *    process group ID, or 0 if no stage could be started.
+ */
+/* 
+	The signal SIGCHLD stays blocked for the whole life of the shell and is only read from the signalfd by the event loop, which is not run while a new job is added to the job list. This ensures correct sequence of execution and that there is no race condition while adding or deleting a job which are the critical section of the code.
 	   
-	If SIGCHLD is not blocked, we may have the job being deleted from the job list (and the child being reaped) in the SIGCHLD handler even before being added to the job list due to race condition.
+	If SIGCHLD could be handled here, we may have the job being deleted from the job list (and the child being reaped) in the SIGCHLD handler even before being added to the job list due to race condition.
 	   
-	The child inherits the blocked vector of the parent, hence it must unblock SIGCHLD before executing the command.
-	   */
-	if(!is_builtin_cmd) {
-		sigemptyset(&sSet); /* initialising signal set */
-		sigaddset(&sSet,SIGCHLD); /* adding SIGCHLD to the signal set */
-		/* blocking the SIGCHLD signal using sigprocmask without affecting other signals */
-		if(sigprocmask(SIG_BLOCK,&sSet,NULL) < 0)
-			unix_error("sigprocmask error\n");
-		pid = fork();
+	The child inherits the blocked vector of the parent, hence it must be given the original signal mask before executing the command. spawnjob() takes care of that for both launch paths.
+	
+	All the stages of a pipeline are started at once, connected by pipes, and put in the process group of the first stage that could be started. The whole pipeline is one job, so ctrl-c, ctrl-z, fg and bg act on every stage. In a subshell every job stays in the subshell's group (jobpgid), which its parent controls as one job.
+*/
+pid_t startjob(struct pipeline_t *pl, int state, char *cmdline)
+{
+	char ***cmds = pl->cmds;
+	int ncmds = pl->ncmds;
+	struct redir_t *r = pl->redirs; /* the redirections of stage i */
+	int i, n, killed = 0;
+	int infd = STDIN_FILENO, outfd, fds[2]; /* pipe between consecutive stages */
+	pid_t pid, pgid = 0, group = jobpgid; /* the job's ID, its process group */
+	struct capture_t *cap;
+	int place;
+	
+	fflush(stdout); /* what the shell printed so far comes before the job's output */
+	cap = state == BG ? capbegin() : NULL; /* with -O its output goes to a ring */
+	place = state == BG ? pinbegin() : -1; /* with pin -p it runs on CPUs of its own */
+	for(i = 0; i < ncmds; i++) {
+		outfd = STDOUT_FILENO;
+		if(i < ncmds-1) {
+			if(pipe2(fds,O_CLOEXEC) < 0)
+				unix_error("pipe error");
+			outfd = fds[1];
+		}
+		for(n = 0; r + n < pl->redirs + pl->nredirs && r[n].stage == i; n++)
+			;
+		/* start the stage; the child gets the signal mask the shell started with */
+		pid = spawnjob(cmds[i],r,n,&origmask,group,infd,outfd);
+		r += n;
+		if(pid != 0) {
+			if(pgid == 0) {
+				pgid = pid;
+				if(group == 0)
+					group = pid;
+				if(!addjob(jobs,pgid,state,cmdline)) /* add job to the joblist */
+					pid = 0;
+			}
+			else if(!addjobpid(jobs,pgid,pid))
+				pid = 0;
+			/* a process missing from the job list could never be reaped or controlled: kill the job */
+			if(pid == 0) {
+				kill(-pgid,SIGKILL);
+				killed = 1;
+			}
+		}
+		/* the children hold their own copies of the pipe ends */
+		if(infd != STDIN_FILENO)
+			close(infd);
+		if(outfd != STDOUT_FILENO)
+			close(outfd);
+		if(i < ncmds-1)
+			infd = fds[0];
+		if(killed) {
+			if(i < ncmds-1)
+				close(infd);
+			if(getjobpid(jobs,pgid) == NULL)
+				pgid = 0;
+			break;
+		}
+	}
+	pinend(place,pgid);
+	capend(cap,pgid);
+	return pgid; /* 0 if no stage could be started */
+}
+
+/*
+ * spawnjob - Start argv[0], looked up through PATH, as a new child in
+ *    process group pgid (a new group if pgid is 0), with infd and outfd
+ *    as its standard input and output, then the nr redirections r, and
+ *    its signal mask set to *mask. The assignments VAR=x in front of the
+ *    command are only put in its environment. Returns the child's PID,
+ *    or 0 if the command could not be started.
+ */
+/*
+	The files of the redirections are opened by the shell, so that a missing file is reported like a missing command, and the child only dup2()s them into place: posix_spawn() is given them as file actions.
+*/
+pid_t spawnjob(char **argv, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd)
+{
+	pid_t pid;
+	int n;
+	
+	for(n = 0; argv[n] != NULL && isassign(argv[n]); n++)
+		;
+	if(argv[n] == NULL) /* only assignments: nothing to run */
+		return 0;
+	if(redirsetup(r,nr) < 0)
+		return 0;
+	if(argv[0] == groupword)
+		pid = spawngroup((struct group_t *)argv,r,nr,mask,pgid,infd,outfd);
+	else if(n == 0)
+		pid = spawncmd(argv,envget(),r,nr,mask,pgid,infd,outfd);
+	else {
+		pid = spawncmd(argv + n,envlayer(argv,n),r,nr,mask,pgid,infd,outfd);
+		envunlayer();
+	}
+	redirclose(r,nr);
+	return pid;
+}
+
+/*
+ * spawncmd - Start argv[0] like spawnjob, with environment envp
+ */
+/*
+	By default the child is created with posix_spawn(), which glibc implements with clone(CLONE_VM|CLONE_VFORK): the child borrows the shell's address space until it calls execve, so no page tables are copied no matter how large the shell has grown. POSIX_SPAWN_SETPGROUP puts the child in its process group (the same as setpgid(0,pgid) in the child) and POSIX_SPAWN_SETSIGMASK gives it the unblocked mask before it executes the command.
+	
+	The -f option selects the original fork() + execve() path so that the two can be compared. On that path a failed execve happens in the child, so a stale cache entry is only noticed by posix_spawn() or "hash -r".
+	
+	The shell opens its pipes with O_CLOEXEC, so the child only keeps the ends that are dup'ed onto its standard input and output.
+*/
+pid_t spawncmd(char **argv, char **envp, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd)
+{
+	pid_t pid;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions;
+	char *path; /* location of the command found through PATH */
+	int err, i;
+	struct timespec start; /* when the launch began, for the trace */
+	struct builtin_t *b;
+	
+	/* a builtin is run by a forked copy of the shell */
+	if((b = findbuiltin(argv[0])) != NULL) {
+		if((pid = fork()) < 0)
+			unix_error("fork error");
+		if(pid == 0) {
+			setpgid(0,pgid);
+			if(infd != STDIN_FILENO)
+				dup2(infd,STDIN_FILENO);
+			if(outfd != STDOUT_FILENO)
+				dup2(outfd,STDOUT_FILENO);
+			redirdup(r,nr);
+			Signal(SIGCHLD,SIG_DFL); /* the shell's handlers (-a) */
+			Signal(SIGINT,SIG_DFL);
+			Signal(SIGTSTP,SIG_DFL);
+			sigprocmask(SIG_SETMASK,mask,NULL);
+			epfd = -1; /* the event loop and the trace belong to the shell */
+			tracebuf.fd = -1;
+			err = b->fn(argv);
+			fflush(stdout);
+			_exit(err);
+		}
+		setpgid(pid,pgid ? pgid : pid);
+		trace(TR_FORK,pid,0,0,NULL);
+		return pid;
+	}
+	
+	if((path = findcmd(argv[0])) == NULL) {
+		printf("%s: Command not found\n", argv[0]);
+		return 0;
+	}
+	
+	if(tracebuf.fd >= 0)
+		clock_gettime(CLOCK_MONOTONIC,&start);
+	if(zygfd >= 0 && nr == 0) { /* the fork server only passes the standard descriptors */
+		pid = zygspawn(path,argv,envp,mask,pgid,infd,outfd);
+		/* the cached location is stale: forget it and search PATH again */
+		if(pid == 0 && errno == ENOENT && hashforget(argv[0]) && (path = findcmd(argv[0])) != NULL)
+			pid = zygspawn(path,argv,envp,mask,pgid,infd,outfd);
+		if(pid == 0 && (errno == EAGAIN || errno == ENOMEM))
+			unix_error("fork server error");
+		if(pid == 0) {
+			printf("%s: Command not found\n", argv[0]);
+			return 0;
+		}
+		/* the fork server replies once the child has executed the command */
+		trace(TR_FORK,pid,0,0,&start);
+		trace(TR_EXEC,pid,0,0,NULL);
+		return pid;
+	}
+	if(use_fork) {
 		/* check if fork() was unsuccessful and child process has not been created */
-		if(pid < 0)
+		if((pid = fork()) < 0)
 			unix_error("fork error\n");
 		if(pid == 0) { /* child runs the user job */
 		/*
-			Initially when the child process is forked, it inherits the process group ID of the parent process. Hence if SIGTSTP or SIGINT is sent to the child process, the parent process being in the same process group also receives the signal and will be stopped or terminated respectively. Hence setpgid(0,0) function is used to set the process group ID of child process to its PID so that the parent process is not stopped or terminated due to the corresponding signal being sent to the child process.	
+			Initially when the child process is forked, it inherits the process group ID of the parent process. Hence if SIGTSTP or SIGINT is sent to the child process, the parent process being in the same process group also receives the signal and will be stopped or terminated respectively. Hence setpgid(0,pgid) function is used to set the process group ID of child process to its PID (or to the group of the pipeline) so that the parent process is not stopped or terminated due to the corresponding signal being sent to the child process.	
 		*/
-			setpgid(0,0);
+			setpgid(0,pgid);
+			if(infd != STDIN_FILENO)
+				dup2(infd,STDIN_FILENO);
+			if(outfd != STDOUT_FILENO)
+				dup2(outfd,STDOUT_FILENO);
+			redirdup(r,nr);
 			/* unblocking SIGCHLD signal using sigprocmask */
-			if(sigprocmask(SIG_UNBLOCK,&sSet,NULL) < 0)
+			if(sigprocmask(SIG_SETMASK,mask,NULL) < 0)
 				unix_error("sigprocmask error\n");
 			/* executing the command using execve() */
-			if(execve(argv[0],argv,environ) < 0) { 
+			/* _exit: the shell's exit handlers (the trace, the control socket) are not the child's */
+			if(execve(path,argv,envp) < 0) { 
 				printf("%s: Command not found\n", argv[0]);
-				exit(0);
+				fflush(stdout);
+				_exit(127);
 			}	
 		}
-		if(!is_bg) { 
-		/*
-			If the job to be executed is a foreground job, then add it to the joblist with state being 'FG'(i.e. foreground) and unblock the SIGCHLD signal.
-			
-			waitfg is called then to ensure that there is only one job running in the foreground.
-		*/
-				addjob(jobs,pid,FG,cmdline); /* add job to the joblist */
-				/* unblocking SIGCHLD signal using sigprocmask */
-				if(sigprocmask(SIG_UNBLOCK,&sSet,NULL) < 0)
-					unix_error("sigprocmask error\n");
-				waitfg(pid); /* ensuring only 1 foreground process is there */
-		} else {
-		/*
-			If the job to be executed is a background job, then add it to the joblist with state being 'BG'(i.e. background) and unblock the SIGCHLD signal.
-			
-			There can be multible jobs running in the background. Hence, we do have to wait for the job to terminate before adding another background job.
-		*/
-			addjob(jobs,pid,BG,cmdline); /* add job to the joblist */
-			printf("[%d] (%d) %s", pid2jid(pid),pid,cmdline); 
-			/* unblocking SIGCHLD signal using sigprocmask */
-			if(sigprocmask(SIG_UNBLOCK,&sSet,NULL) < 0)
-				unix_error("sigprocmask error\n");
+		/* also set the group here, so that it is in place before the next stage joins it */
+		setpgid(pid,pgid ? pgid : pid);
+		trace(TR_FORK,pid,0,0,&start);
+		trace(TR_EXEC,pid,0,0,NULL); /* here: fork() returned, the child execs on its own */
+		return pid;
+	}
+	
+	if((err = posix_spawnattr_init(&attr)) != 0 ||
+	   (err = posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETPGROUP|POSIX_SPAWN_SETSIGMASK)) != 0 ||
+	   (err = posix_spawnattr_setpgroup(&attr,pgid)) != 0 ||
+	   (err = posix_spawnattr_setsigmask(&attr,mask)) != 0 ||
+	   (err = posix_spawn_file_actions_init(&actions)) != 0 ||
+	   (infd != STDIN_FILENO && (err = posix_spawn_file_actions_adddup2(&actions,infd,STDIN_FILENO)) != 0) ||
+	   (outfd != STDOUT_FILENO && (err = posix_spawn_file_actions_adddup2(&actions,outfd,STDOUT_FILENO)) != 0)) {
+		errno = err;
+		unix_error("posix_spawnattr error");
+	}
+	for(i = 0; i < nr; i++) /* then the redirections, in order */
+		if((err = r[i].src < 0 ? posix_spawn_file_actions_addclose(&actions,r[i].fd) :
+		    posix_spawn_file_actions_adddup2(&actions,r[i].src,r[i].fd)) != 0) {
+			errno = err;
+			unix_error("posix_spawn_file_actions error");
 		}
+	err = posix_spawn(&pid,path,&actions,&attr,argv,envp);
+	/* the cached location is stale: forget it and search PATH again */
+	if(err == ENOENT && hashforget(argv[0]) && (path = findcmd(argv[0])) != NULL)
+		err = posix_spawn(&pid,path,&actions,&attr,argv,envp);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if(err == EAGAIN || err == ENOMEM) {
+		errno = err;
+		unix_error("posix_spawn error");
 	}
-	return;
+	if(err != 0) { /* the exec failed: the child has already exited */
+		printf("%s: Command not found\n", argv[0]);
+		return 0;
+	}
+	/* posix_spawn() returns once the child has executed the command */
+	trace(TR_FORK,pid,0,0,&start);
+	trace(TR_EXEC,pid,0,0,NULL);
+	return pid;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+/*
+ * spawngroup - Start a subshell running the list of g like spawncmd.
+ *    It exits with the status of the list.
  */
-int parseline(const char *cmdline, char **argv) 
+/*
+	The subshell is a forked copy of the shell that already holds the tokens of the line, so nothing is parsed again. It puts its own jobs in its process group, and leaves ctrl-c and ctrl-z to the kernel: when the parent shell sends them to the group, the subshell is interrupted or stopped with its commands, and fg and bg resume them all together.
+*/
+pid_t spawngroup(struct group_t *g, struct redir_t *r, int nr, sigset_t *mask, pid_t pgid, int infd, int outfd)
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
-    int bg;                     /* background job? */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
-
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
-    }
-
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
+	pid_t pid;
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
+	if((pid = fork()) < 0)
+		unix_error("fork error");
+	if(pid == 0) {
+		setpgid(0,pgid);
+		if(infd != STDIN_FILENO)
+			dup2(infd,STDIN_FILENO);
+		if(outfd != STDOUT_FILENO)
+			dup2(outfd,STDOUT_FILENO);
+		redirdup(r,nr);
+		initsubshell(mask);
+		runlist(g->lx,g->start,g->end,NULL);
+		fflush(stdout);
+		_exit(laststatus);
 	}
-	else {
-	    delim = strchr(buf, ' ');
-	}
-    }
-    argv[argc] = NULL;
-    
-    if (argc == 0)  /* ignore blank line */
-	return 1;
-
-    /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
-    }
-    return bg;
+	setpgid(pid,pgid ? pgid : pid);
+	trace(TR_FORK,pid,0,0,NULL);
+	return pid;
 }
 
 /* 
@@ -299,32 +1284,29 @@ int parseline(const char *cmdline, char **argv)
 /*
 	If first argument in cmdline is a built in command, run it and return.
 	
-	There are 4 built-in commands - quit, jobs, fg, bg. These commands must be executed immediately.
+	The built-in commands are listed in builtintab: the job control commands quit, jobs, fg, bg, wait, sched and hash, cd, export, unset and output, and the utilities echo, true, false, test, [, printf, pwd and sleep. (time is handled by runpipeline as it prefixes a whole pipeline.) Its exit status is left in laststatus.
+	
+	A background command needs a process of its own, so with bg set only the commands that act on the shell itself are run here; spawnjob() forks for the others.
 	
-	return value: 0 - if cmdline is not a built-in command
+	The nr redirections r are made on the shell's own descriptors for the time the builtin runs, so that it never needs a fork. A command of redirections only (argv[0] is NULL) just makes them, creating or truncating the files.
+	
+	return value: 0 - if cmdline is not a built-in command (or must be run as a job)
 	1 - if cmdline is a built-in command. 
 	(cmdline is stored in argv after parsing and builtin_cmd accesses argv to check if cmdline is a built-in command.)
 */
-int builtin_cmd(char **argv) 
+int builtin_cmd(char **argv, int bg, struct redir_t *r, int nr) 
 {
-	/* quit the process immediately using exit() function */
-	if(!strcmp(*argv, "quit")) { 
-		exit(0);
-	}
-	
-	/* list the jobs in joblist */
-	if(!strcmp(*argv, "jobs")) { 
-		listjobs(jobs); 
-		return 1;
-	}
+	struct builtin_t *b = NULL;
 	
-	/* resuming a stopped process in FG or BG */
-	if(!strcmp(*argv, "fg") || !strcmp(*argv, "bg")) { 
-		do_bgfg(argv);
+	if(*argv != NULL && ((b = findbuiltin(*argv)) == NULL || (bg && !b->inshell))) /* not a builtin command */
+		return 0;
+	if(redirsave(r,nr) < 0) {
+		laststatus = 1;
 		return 1;
 	}
-	
-    return 0;     /* not a builtin command */
+	laststatus = b != NULL ? b->fn(argv) : 0;
+	redirrestore(r,nr);
+	return 1;
 }
 
 /* 
@@ -340,7 +1322,9 @@ void do_bgfg(char **argv)
 		return;
 	}
 	
-	int arg = atoi(argv[1]+1); /* converting the job/process id to int using atoi. */
+	struct job_t *job; /* job named by the argument */
+	/* converting the job/process id to int using atoi. */
+	int arg = atoi(argv[1][0] == '%' ? argv[1]+1 : argv[1]);
 	
 	/* the value of argument must be a valid integer corresponding to jid or pid. */
 	if((argv[1][0] < '0' || argv[1][0] > '9') && argv[1][0] != '%') {
@@ -350,20 +1334,34 @@ void do_bgfg(char **argv)
 	
 	/* the argument value must correspond to some job in the joblist. */
 	if(argv[1][0] == '%') {
-		if(getjobjid(jobs,arg) == NULL) {
+		if((job = getjobjid(jobs,arg)) == NULL) {
 			printf("%%%d: No such job\n",arg);
 			return;
 		}
 	}
 	
 	/* the argument value must correspond to some job in the joblist. */
-	if(argv[1][0] != '%' && getjobpid(jobs,arg) == NULL) {
+	else if((job = getjobpid(jobs,arg)) == NULL) {
 		printf("(%d): No such process\n",arg);
 		return;
 	}
 	
 	/* end of error handling section. */
 	
+	/*
+		A queued job has no process yet: it is started right away, whatever the limits set with sched.
+	*/
+	if(job->state == QU) {
+		pid_t pid = schedstart(job,!strcmp(*argv,"fg") ? FG : BG);
+		if(pid == 0)
+			return;
+		if(!strcmp(*argv,"fg"))
+			waitfg(pid);
+		else
+			printf("[%d] (%d) %s",pid2jid(pid),pid,getjobpid(jobs,pid)->cmdline);
+		return;
+	}
+	
 	/*
 		When the bg command is executed,the stopped process resumes execution on receiveing the SIGCONT signal and runs in the background.
 		
@@ -372,23 +1370,11 @@ void do_bgfg(char **argv)
 		After sending the SIGCONT signal, the state of the job is now background(i.e. BG).
 	*/
 	if(!strcmp(*argv,"bg")) {
-		int jid = atoi(*(argv+1)+1); /* converting argument to int */
-		
-		/* if jid of the job is mentioned in the command, it is preceded by '%'. */
-		if(argv[1][0] == '%') {
-			kill(-(jobs[jid-1].pid),SIGCONT); /* sending SIGCONT to the job */
-			jobs[jid-1].state = BG; /* change status of job to 'BG' */
-			printf("[%d] (%d) %s",jid,jobs[jid-1].pid,jobs[jid-1].cmdline);			
-		}
-		
-		/* if pid of the job is mentioned in the command.*/
-		else {
-			pid_t pid = jid;
-			jid = pid2jid(pid); /* obtaining jid given pid of process */
-			kill(-pid,SIGCONT); /* sending SIGCONT to the job */
-			jobs[jid-1].state = BG; /* change status of job to 'BG' */
-			printf("[%d] (%d) %s",jid,pid,jobs[jid-1].cmdline);
-		}
+		printf("[%d] (%d) %s",job->jid,job->pid,job->cmdline);
+		fflush(stdout); /* before the job prints anything */
+		trace(TR_CONT,job->pid,job->jid,BG,NULL);
+		kill(-job->pid,SIGCONT); /* sending SIGCONT to the job */
+		setjobstate(jobs,job,BG); /* change status of job to 'BG' */
 	}
 	
 	/*
@@ -401,310 +1387,5800 @@ void do_bgfg(char **argv)
 		Since the resumed process is now running in the foreground, waitfg() function is called to ensure that there is only foreground process being executed at any time.
 	*/
 	else if(!strcmp(*argv,"fg")) {
-		int jid = atoi(*(argv+1)+1); /* converting argument into int */
-		pid_t pid = 0;
-		
-		/* if jid of the job is mentioned in the command, it is preceded by '%'. */
-		if(argv[1][0] == '%') {
-			pid = jobs[jid-1].pid; /* obtain pid of the job from joblist using jid */
-			kill(-(jobs[jid-1].pid),SIGCONT); /* sending SIGCONT to the job */ 
-			jobs[jid-1].state = FG; /* change status of job to 'FG' */
+		pid_t pid = job->pid;
+		fflush(stdout); /* before the job prints anything */
+		trace(TR_CONT,pid,job->jid,FG,NULL);
+		kill(-pid,SIGCONT); /* sending SIGCONT to the job */ 
+		setjobstate(jobs,job,FG); /* change status of job to 'FG' */
+		waitfg(pid);
+	}
+    return;
+}
+
+/*
+ * do_hash - Execute the builtin hash command
+ */
+/*
+	hash       : list the cached command locations and their hit counts.
+	hash -r    : forget every cached location.
+	hash name..: search PATH for each name and cache the result.
+*/
+void do_hash(char **argv)
+{
+	struct cmdhash_t *h;
+	int i, empty = 1;
+	
+	if(argv[1] != NULL && !strcmp(argv[1],"-r")) {
+		hashclear();
+		return;
+	}
+	
+	if(argv[1] != NULL) {
+		for(i = 1; argv[i] != NULL; i++)
+			if(findcmd(argv[i]) == NULL)
+				printf("hash: %s: not found\n",argv[i]);
+		return;
+	}
+	
+	for(i = 0; i < CMDHASHSIZE; i++) {
+		for(h = cmdhash[i]; h != NULL; h = h->next) {
+			if(empty)
+				printf("hits\tcommand\n");
+			empty = 0;
+			printf("%4d\t%s\n",h->hits,h->path);
 		}
-		
-		/* if pid of the job is mentioned in the command.*/
+	}
+	if(empty)
+		printf("hash: hash table empty\n");
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+ 
+/*
+	waitfg() ensures that there is only one foreground process being executed at any time. This is done by bolcking furher execution until the foreground process running (as given by the pid argument) i.terminates or ii.stops and shifts to the background.
+	
+	Hence, waitfg() is called each time a new process is added in the foreground(FG) state.
+	
+	The event loop is run until the job has been reaped or stopped. SIGCHLD is only handled inside evwait(), between two checks of the job table, so it cannot be lost between the check and the wait (which could happen with pause() when the job finished before pause() was reached), and background jobs that finish meanwhile are simply reaped without waking us up early.
+*/
+void waitfg(pid_t pid)
+{
+	struct job_t *job;
+	
+	/* wait until the job is reaped or no longer in the foreground */
+	fgpgid = pid; /* where sigint_handler and sigtstp_handler send ctrl-c and ctrl-z */
+	while((job = getjobpid(jobs,pid)) != NULL && job->state == FG)
+		evwait(-1);
+	fgpgid = 0;
+	return;
+}
+
+/*******************
+ * Builtin commands
+ *******************/
+
+/*
+ * Besides the job control builtins, the shell runs a few utilities
+ * that scripts call all the time in-process: echo, true, false, test
+ * and [, printf, cd, pwd and sleep. A simple foreground command runs
+ * them without creating any process, as well as wait, which blocks in
+ * the event loop until background jobs finish. As a stage of a pipeline or in
+ * the background they run in a forked child of the shell (see
+ * spawnjob), so that they can be connected and controlled like any
+ * other job, but still without an execve.
+ *
+ * Lookup is a perfect hash on the length and the first and last
+ * characters of the name, like the tables gperf generates (gperf
+ * -k1,$): every builtin has a slot of its own in builtintab, so a
+ * lookup is one hash and one strcmp. When a builtin is added, asso[]
+ * has to be chosen again so that no two names share a slot.
+ */
+
+static int bi_quit(char **argv);
+static int bi_jobs(char **argv);
+static int bi_bgfg(char **argv);
+static int bi_hash(char **argv);
+static int bi_echo(char **argv);
+static int bi_true(char **argv);
+static int bi_false(char **argv);
+static int bi_test(char **argv);
+static int bi_printf(char **argv);
+static int bi_cd(char **argv);
+static int bi_pwd(char **argv);
+static int bi_sleep(char **argv);
+static int bi_wait(char **argv);
+static int bi_sched(char **argv);
+static int bi_export(char **argv);
+static int bi_unset(char **argv);
+static int bi_output(char **argv);
+static int bi_pin(char **argv);
+
+#define BUILTINSIZE 32      /* slots in builtintab, a power of 2 */
+
+static const unsigned char asso[256] = {
+    ['['] = 5, ['b'] = 17, ['c'] = 20, ['d'] = 0, ['e'] = 22, ['f'] = 1,
+    ['g'] = 6, ['h'] = 10, ['j'] = 14, ['n'] = 2, ['o'] = 8, ['p'] = 26,
+    ['q'] = 9, ['s'] = 27, ['t'] = 23, ['u'] = 19, ['w'] = 11,
+};
+
+static struct builtin_t builtintab[BUILTINSIZE] = {
+    [0]  = { "sched",  bi_sched,  1 },
+    [1]  = { "printf", bi_printf, 0 },
+    [2]  = { "echo",   bi_echo,   0 },
+    [4]  = { "quit",   bi_quit,   1 },
+    [5]  = { "output", bi_output, 1 },
+    [6]  = { "wait",   bi_wait,   1 },
+    [9]  = { "fg",     bi_bgfg,   1 },
+    [11] = { "[",      bi_test,   0 },
+    [13] = { "jobs",   bi_jobs,   1 },
+    [15] = { "unset",  bi_unset,  1 },
+    [17] = { "true",   bi_true,   0 },
+    [18] = { "test",   bi_test,   0 },
+    [19] = { "export", bi_export, 1 },
+    [22] = { "cd",     bi_cd,     1 },
+    [24] = { "hash",   bi_hash,   1 },
+    [25] = { "bg",     bi_bgfg,   1 },
+    [26] = { "sleep",  bi_sleep,  0 },
+    [28] = { "false",  bi_false,  0 },
+    [29] = { "pwd",    bi_pwd,    0 },
+    [31] = { "pin",    bi_pin,    1 },
+};
+
+/* findbuiltin - Return the builtin called name, NULL if there is none */
+struct builtin_t *findbuiltin(const char *name)
+{
+    size_t len = strlen(name);
+    struct builtin_t *b;
+
+    if (len == 0)
+	return NULL;
+    b = &builtintab[(len + asso[(unsigned char)name[0]] + 
+		     asso[(unsigned char)name[len-1]]) & (BUILTINSIZE - 1)];
+    return b->name != NULL && !strcmp(b->name, name) ? b : NULL;
+}
+
+/* quit - Exit the shell */
+static int bi_quit(char **argv)
+{
+    exit(0);
+}
+
+/* jobs [-l] - List the jobs, with -l also the resources they used */
+static int bi_jobs(char **argv)
+{
+    listjobs(jobs, argv[1] != NULL && !strcmp(argv[1], "-l"));
+    return 0;
+}
+
+static int bi_bgfg(char **argv)
+{
+    do_bgfg(argv);
+    return 0;
+}
+
+static int bi_hash(char **argv)
+{
+    do_hash(argv);
+    return 0;
+}
+
+static int bi_true(char **argv)
+{
+    return 0;
+}
+
+static int bi_false(char **argv)
+{
+    return 1;
+}
+
+/* echo [-n] args - Print the arguments */
+static int bi_echo(char **argv)
+{
+    int i = 1, nl = 1;
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-n")) {
+	nl = 0;
+	i++;
+    }
+    for (; argv[i] != NULL; i++) {
+	fputs(argv[i], stdout);
+	if (argv[i+1] != NULL)
+	    putchar(' ');
+    }
+    if (nl)
+	putchar('\n');
+    return 0;
+}
+
+/* escchar - Return the character that backslash c stands for, -1 if none */
+static int escchar(int c)
+{
+    static const char from[] = "ntrabfv\\", to[] = "\n\t\r\a\b\f\v\\";
+    const char *p = c != '\0' ? strchr(from, c) : NULL;
+
+    return p != NULL ? to[p - from] : -1;
+}
+
+/* 
+ * printfb - Copy s to out, which has room for it, with its backslash
+ *    escapes replaced for %b: those of the format, and \0nnn in octal.
+ *    Returns 1 if s has \c, which ends all output there.
+ */
+static int printfb(const char *s, char *out)
+{
+    int c, k;
+
+    for (; *s != '\0'; s++) {
+	if (*s != '\\' || s[1] == '\0') {
+	    *out++ = *s;
+	    continue;
+	}
+	if (*++s == 'c') {
+	    *out = '\0';
+	    return 1;
+	}
+	if (*s == '0') {
+	    for (c = 0, k = 0; k < 3 && s[1] >= '0' && s[1] <= '7'; k++)
+		c = 8 * c + *++s - '0';
+	    *out++ = c;
+	}
+	else if ((c = escchar(*s)) >= 0)
+	    *out++ = c;
+	else {
+	    *out++ = '\\';
+	    *out++ = *s;
+	}
+    }
+    *out = '\0';
+    return 0;
+}
+
+/* 
+ * printf format args - Print the arguments under control of format.
+ *    Supports the conversions %s %b %c %d %i %u %o %x %X and %%, with
+ *    flags, width and precision, and the usual backslash escapes. %b
+ *    prints its argument with the escapes in it replaced (see printfb).
+ *    The format is reused while arguments remain.
+ */
+static int bi_printf(char **argv)
+{
+    char spec[32], *f, *s, *t, *end;
+    char **arg = &argv[2], **first;
+    long num;
+    int c, n, stop, status = 0;
+
+    if (argv[1] == NULL) {
+	printf("printf: usage: printf format [arguments]\n");
+	return 2;
+    }
+    do {
+	first = arg;
+	for (f = argv[1]; *f != '\0'; f++) {
+	    if (*f == '\\' && f[1] != '\0') {
+		if ((c = escchar(*++f)) >= 0)
+		    putchar(c);
 		else {
-			pid_t pid = jid;
-			jid = pid2jid(pid); /* obtaining jid given pid of process */
-			kill(-pid,SIGCONT); /* sending SIGCONT to the job */
-			jobs[jid-1].state = FG; /* change status of job to 'FG'*/
-		}	
-		waitfg(pid);
+		    putchar('\\');
+		    putchar(*f);
+		}
+		continue;
+	    }
+	    if (*f != '%') {
+		putchar(*f);
+		continue;
+	    }
+	    if (f[1] == '%') {
+		putchar(*++f);
+		continue;
+	    }
+	    /* copy the conversion with its flags, width and precision */
+	    n = strspn(f + 1, "-+ #0123456789.") + 1;
+	    if (f[n] == '\0' || n > (int)sizeof(spec) - 3) {
+		printf("printf: %s: invalid format\n", f);
+		return 1;
+	    }
+	    memcpy(spec, f, n);
+	    s = *arg != NULL ? *arg++ : "";
+	    switch (f[n]) {
+	    case 's':
+		spec[n] = 's', spec[n+1] = '\0';
+		printf(spec, s);
+		break;
+	    case 'b':
+		if ((t = malloc(strlen(s) + 1)) == NULL)
+		    unix_error("printf error");
+		stop = printfb(s, t);
+		spec[n] = 's', spec[n+1] = '\0';
+		printf(spec, t);
+		free(t);
+		if (stop)
+		    return status;
+		break;
+	    case 'c':
+		spec[n] = 'c', spec[n+1] = '\0';
+		printf(spec, *s);
+		break;
+	    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		spec[n] = 'l', spec[n+1] = f[n], spec[n+2] = '\0';
+		errno = 0;
+		num = strtol(s, &end, 0);
+		if (errno != 0 || *end != '\0') {
+		    printf("printf: %s: invalid number\n", s);
+		    status = 1;
+		}
+		printf(spec, num);
+		break;
+	    default:
+		printf("printf: %%%c: invalid conversion\n", f[n]);
+		return 1;
+	    }
+	    f += n;
+	}
+    } while (*arg != NULL && arg > first);  /* reuse the format */
+    return status;
+}
+
+/* 
+ * test expr, [ expr ] - Evaluate a conditional expression: a string,
+ *    ! expr, a unary file or string test (-e -f -d -r -w -x -s -L -n
+ *    -z), or a binary string or integer comparison (= != -eq -ne -lt
+ *    -le -gt -ge). Returns 0 if true, 1 if false, 2 on error.
+ */
+static int bi_test(char **argv)
+{
+    static const char *binops[] = { "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    struct stat st;
+    char **a = argv + 1;
+    int argc, neg = 0, i, r;
+    long x, y;
+    char *end1, *end2;
+
+    for (argc = 0; a[argc] != NULL; argc++)
+	;
+    if (!strcmp(argv[0], "[")) {
+	if (argc == 0 || strcmp(a[argc-1], "]")) {
+	    printf("[: missing `]'\n");
+	    return 2;
+	}
+	argc--;
+    }
+    if (argc > 1 && !strcmp(a[0], "!")) {
+	neg = 1;
+	a++, argc--;
+    }
+
+    if (argc == 0)
+	r = 0;
+    else if (argc == 1)
+	r = a[0][0] != '\0';
+    else if (argc == 2 && a[0][0] == '-' && a[0][1] != '\0' && a[0][2] == '\0') {
+	switch (a[0][1]) {
+	case 'n': r = a[1][0] != '\0'; break;
+	case 'z': r = a[1][0] == '\0'; break;
+	case 'e': r = stat(a[1], &st) == 0; break;
+	case 'f': r = stat(a[1], &st) == 0 && S_ISREG(st.st_mode); break;
+	case 'd': r = stat(a[1], &st) == 0 && S_ISDIR(st.st_mode); break;
+	case 's': r = stat(a[1], &st) == 0 && st.st_size > 0; break;
+	case 'L': r = lstat(a[1], &st) == 0 && S_ISLNK(st.st_mode); break;
+	case 'r': r = access(a[1], R_OK) == 0; break;
+	case 'w': r = access(a[1], W_OK) == 0; break;
+	case 'x': r = access(a[1], X_OK) == 0; break;
+	default:
+	    printf("%s: %s: unary operator expected\n", argv[0], a[0]);
+	    return 2;
+	}
+    }
+    else if (argc == 3) {
+	for (i = 0; i < 8 && strcmp(a[1], binops[i]); i++)
+	    ;
+	if (i == 8) {
+	    printf("%s: %s: binary operator expected\n", argv[0], a[1]);
+	    return 2;
+	}
+	if (i < 2)
+	    r = (strcmp(a[0], a[2]) == 0) == (i == 0);
+	else {
+	    x = strtol(a[0], &end1, 10);
+	    y = strtol(a[2], &end2, 10);
+	    if (a[0][0] == '\0' || *end1 != '\0' || a[2][0] == '\0' || *end2 != '\0') {
+		printf("%s: integer expression expected\n", argv[0]);
+		return 2;
+	    }
+	    r = i == 2 ? x == y : i == 3 ? x != y : i == 4 ? x < y : 
+		i == 5 ? x <= y : i == 6 ? x > y : x >= y;
+	}
+    }
+    else {
+	printf("%s: too many arguments\n", argv[0]);
+	return 2;
+    }
+    return (r != neg) ? 0 : 1;
+}
+
+/* cd [dir] - Change the working directory, to $HOME by default */
+static int bi_cd(char **argv)
+{
+    char *dir = argv[1] != NULL ? argv[1] : varget("HOME");
+    char buf[4096];
+
+    if (dir == NULL) {
+	printf("cd: HOME not set\n");
+	return 1;
+    }
+    if (chdir(dir) < 0) {
+	printf("cd: %s: %s\n", dir, strerror(errno));
+	return 1;
+    }
+    if (getcwd(buf, sizeof(buf)) != NULL)
+	varset("PWD", 3, buf, 1);
+    return 0;
+}
+
+/* pwd - Print the working directory */
+static int bi_pwd(char **argv)
+{
+    char buf[4096];
+
+    if (getcwd(buf, sizeof(buf)) == NULL) {
+	printf("pwd: %s\n", strerror(errno));
+	return 1;
+    }
+    printf("%s\n", buf);
+    return 0;
+}
+
+/* 
+ * sleep seconds - Wait for a (fractional) number of seconds. In the
+ *    shell itself the wait runs the event loop, so background jobs are
+ *    still reaped meanwhile and ctrl-c ends it.
+ */
+static int bi_sleep(char **argv)
+{
+    struct timespec now, end;
+    double secs;
+    char *e;
+    long ms;
+
+    if (argv[1] == NULL || (secs = strtod(argv[1], &e)) < 0 || *e != '\0') {
+	printf("sleep: invalid time interval\n");
+	return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += (time_t)secs;
+    end.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+    if (end.tv_nsec >= 1000000000) {
+	end.tv_sec++;
+	end.tv_nsec -= 1000000000;
+    }
+
+    if (epfd < 0) {          /* in a forked child */
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL) == EINTR)
+	    ;
+	return 0;
+    }
+    interrupted = 0;
+    while (!interrupted) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	if (ms <= 0)
+	    return 0;
+	evwait(ms > 1000000 ? 1000000 : ms);
+    }
+    return 130;             /* like a command killed by SIGINT */
+}
+
+/* jobdone - Remember that background job pid (jid) finished with status */
+void jobdone(pid_t pid, int jid, int status)
+{
+    struct donejob_t *d = &donetab.recs[donetab.count++ % DONESIZE];
+
+    d->pid = pid;
+    d->jid = jid;
+    d->status = status;
+    if (donetab.count - donetab.waited > DONESIZE)  /* forget the oldest */
+	donetab.waited = donetab.count - DONESIZE;
+}
+
+/* donestatus - Exit status of a finished job, as $? would show it */
+static int donestatus(struct donejob_t *d)
+{
+    if (WIFSIGNALED(d->status))
+	return 128 + WTERMSIG(d->status);
+    return WEXITSTATUS(d->status);
+}
+
+/* runningjobs - Return the number of jobs running in the background */
+static int runningjobs(void)
+{
+    return jobs->nrunning;
+}
+
+/* 
+ * wait [-n] [%jid|pid ...] - Wait for background jobs. With no
+ *    arguments, wait until none is running and return 0. With -n,
+ *    return the status of the next job to finish (or of one that
+ *    finished since the last wait). Otherwise wait for each job named
+ *    and return the status of the last one; a job that is stopped
+ *    returns 128 plus SIGTSTP, and a queued job is waited for from the
+ *    queue. Jobs are reaped by the event loop
+ *    meanwhile, and ctrl-c ends the wait with status 130.
+ */
+static int bi_wait(char **argv)
+{
+    struct job_t *job;
+    struct donejob_t *d;
+    unsigned int i;
+    int jid, status = 0;
+    pid_t pid;
+
+    if (epfd < 0)           /* a forked child has no jobs */
+	return 0;
+    interrupted = 0;
+
+    if (argv[1] == NULL) {
+	while (runningjobs() + sched.nqueued > 0) {
+	    evwait(-1);
+	    if (interrupted)
+		return 130;
+	}
+	donetab.waited = donetab.count;
+	return 0;
+    }
+
+    if (!strcmp(argv[1], "-n")) {
+	while (donetab.waited == donetab.count) {
+	    if (runningjobs() + sched.nqueued == 0)
+		return 127;
+	    evwait(-1);
+	    if (interrupted)
+		return 130;
+	}
+	return donestatus(&donetab.recs[donetab.waited++ % DONESIZE]);
+    }
+
+    for (argv++; *argv != NULL; argv++) {
+	if (**argv == '%') {
+	    jid = atoi(*argv + 1);
+	    job = getjobjid(jobs, jid);
+	    pid = 0;
+	}
+	else if (**argv >= '0' && **argv <= '9') {
+	    pid = atoi(*argv);
+	    job = getjobpid(jobs, pid);
+	    jid = 0;
+	}
+	else {
+	    printf("wait: %s: argument must be a PID or %%jobid\n", *argv);
+	    status = 2;
+	    continue;
+	}
+	while (job != NULL && job->state == QU) {  /* not started yet */
+	    evwait(-1);
+	    if (interrupted)
+		return 130;
+	    job = getjobjid(jobs, jid);  /* started with the same JID */
+	}
+	if (job != NULL) {
+	    pid = job->pid;
+	    jid = 0;
+	    while ((job = getjobpid(jobs, pid)) != NULL && job->state == BG) {
+		evwait(-1);
+		if (interrupted)
+		    return 130;
+	    }
+	    if (job != NULL) {  /* stopped, or brought to the foreground */
+		status = 128 + SIGTSTP;
+		continue;
+	    }
+	}
+
+	/* the job finished: look for it among the jobs that are kept */
+	for (i = donetab.count, d = NULL; i != donetab.waited; i--) {
+	    d = &donetab.recs[(i - 1) % DONESIZE];
+	    if (jid ? d->jid == jid : d->pid == pid)
+		break;
+	    d = NULL;
+	}
+	if (d != NULL)
+	    status = donestatus(d);
+	else if (jid) {
+	    printf("%%%d: No such job\n", jid);
+	    status = 127;
+	}
+	else {
+	    printf("wait: pid %d is not a child of this shell\n", pid);
+	    status = 127;
+	}
+    }
+    return status;
+}
+
+/* 
+ * sched [-j jobs] [-l load] [-m MB] - Set the limits on background
+ *    jobs: how many run at once, the load average and the memory
+ *    available (MB) below which no more are started. 0 removes a
+ *    limit. With no option, show the limits and the queue.
+ */
+static int bi_sched(char **argv)
+{
+    int maxrun = sched.maxrun;
+    double maxload = sched.maxload;
+    long minmem = sched.minmem;
+    char *e;
+    int i;
+
+    /* nothing changes unless every option is valid */
+    for (i = 1; argv[i] != NULL; i += 2) {
+	e = "";
+	if (strlen(argv[i]) != 2 || argv[i][0] != '-' || argv[i+1] == NULL)
+	    e = argv[i];
+	else if (argv[i][1] == 'j')
+	    maxrun = strtol(argv[i+1], &e, 10);
+	else if (argv[i][1] == 'l')
+	    maxload = strtod(argv[i+1], &e);
+	else if (argv[i][1] == 'm')
+	    minmem = strtol(argv[i+1], &e, 10);
+	else
+	    e = argv[i];
+	if (*e != '\0' || e == argv[i+1] || maxrun < 0 || maxload < 0 || minmem < 0) {
+	    printf("sched: usage: sched [-j jobs] [-l load] [-m MB]\n");
+	    return 2;
+	}
+    }
+    if (argv[1] == NULL) {
+	printf("sched: jobs %d, load %.2f, memory %ldMB; %d running, %d queued\n",
+	       sched.maxrun, sched.maxload, sched.minmem, runningjobs(), sched.nqueued);
+	return 0;
+    }
+    sched.maxrun = maxrun;
+    sched.maxload = maxload;
+    sched.minmem = minmem;
+    schedrun();             /* the limits may have been raised */
+    return 0;
+}
+
+/* export [-p] [name[=value] ...] - Set and export variables, or list them */
+static int bi_export(char **argv)
+{
+    size_t len;
+    char *val;
+    int i, rc = 0;
+
+    if (argv[1] == NULL || (!strcmp(argv[1], "-p") && argv[2] == NULL)) {
+	varexport();
+	return 0;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+	if ((len = isassign(argv[i])) > 0)
+	    varset(argv[i], len, argv[i] + len + 1, 1);
+	else if ((len = varnamelen(argv[i])) == 0 || argv[i][len] != '\0') {
+	    printf("export: `%s': not a valid identifier\n", argv[i]);
+	    rc = 1;
+	}
+	else if ((val = varget(argv[i])) != NULL)
+	    varset(argv[i], len, val, 1);
+    }
+    return rc;
+}
+
+/* 
+ * output [-f] [%jid|pid] - Show what a captured job has written and, with
+ *    -f, what it writes until it is done. Without a job, list the rings.
+ */
+static int bi_output(char **argv)
+{
+    struct capture_t *c;
+    int follow = 0, i = 1;
+    uint64_t kept;
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-f")) {
+	follow = 1;
+	i++;
+    }
+    if (argv[i] == NULL) {
+	for (c = capture.rings; c != NULL; c = c->next)
+	    printf("[%d] (%d) %s, %llu bytes\n", c->jid, c->pgid,
+		   c->open ? "Running" : "Done", (unsigned long long)c->head);
+	return 0;
+    }
+    if ((c = capfind(argv[i])) == NULL) {
+	printf("output: %s: no captured output\n", argv[i]);
+	return 1;
+    }
+    fflush(stdout);
+    kept = c->head < capture.size ? c->head : capture.size;
+    capwrite(c, c->head - kept, kept);
+    if (!follow || epfd < 0)    /* a forked copy of the shell only has the ring */
+	return 0;
+
+    /* capevent prints the rest as it comes */
+    c->follow++;
+    interrupted = 0;
+    while (c->open && !interrupted)
+	evwait(-1);
+    c->follow--;
+    return interrupted ? 130 : 0;
+}
+
+/* 
+ * pin [-p off|rr|least|node] [cpulist|-n node %jid|pid] - Set how
+ *    background jobs are placed on the CPUs, or pin a job to the CPUs
+ *    in cpulist or to those of NUMA node node. With no argument, show
+ *    the policy and how many placed jobs each CPU or node has.
+ */
+static int bi_pin(char **argv)
+{
+    static const char *policies[] = { "off", "rr", "least", "node" };
+    struct job_t *job;
+    cpu_set_t set;
+    char path[64], list[64], *arg = NULL, *e;
+    int i, n;
+
+    if (!pin.ready)
+	pininit();
+    if (argv[1] == NULL) {
+	printf("pin: policy %s, %d cpus, %d nodes", policies[pin.policy],
+	       pin.ncpus, pin.nnodes);
+	for (i = 0; i < pin.ncpus + pin.nnodes; i++)
+	    if (pin.load[i] > 0) {
+		pinset(i, &set);
+		cpulistfmt(&set, list, sizeof(list));
+		printf("; %s %s: %d", i < pin.ncpus ? "cpu" : "node", list, pin.load[i]);
+	    }
+	printf("\n");
+	return 0;
+    }
+    if (!strcmp(argv[1], "-p") && argv[2] != NULL && argv[3] == NULL) {
+	for (i = 0; i < 4; i++)
+	    if (!strcmp(argv[2], policies[i])) {
+		pin.policy = i;
+		return 0;
+	    }
+    }
+    else if (!strcmp(argv[1], "-n") && argv[2] != NULL && argv[3] != NULL && argv[4] == NULL) {
+	n = strtol(argv[2], &e, 10);
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+	if (*e != '\0' || e == argv[2] || n < 0 || cpulistread(path, &set) < 0) {
+	    printf("pin: %s: no such node\n", argv[2]);
+	    return 1;
+	}
+	arg = argv[3];
+    }
+    else if (argv[1][0] != '-' && argv[2] != NULL && argv[3] == NULL) {
+	if (cpulistparse(argv[1], &set) < 0) {
+	    printf("pin: %s: not a cpu list\n", argv[1]);
+	    return 1;
+	}
+	arg = argv[2];
+    }
+    if (arg == NULL) {
+	printf("pin: usage: pin [-p off|rr|least|node] [cpulist|-n node %%jid|pid]\n");
+	return 2;
+    }
+    if ((arg[0] == '%' && (job = getjobjid(jobs, atoi(arg + 1))) == NULL) ||
+	(arg[0] != '%' && (job = getjobpid(jobs, atoi(arg))) == NULL)) {
+	printf(arg[0] == '%' ? "%s: No such job\n" : "(%s): No such process\n", arg);
+	return 1;
+    }
+    if (job->npids == 0 || pinjob(job, &set) < 0) {
+	printf("pin: %s: %s\n", arg, job->npids == 0 ? "not started" : strerror(errno));
+	return 1;
+    }
+    return 0;
+}
+
+/* unset name ... - Remove variables */
+static int bi_unset(char **argv)
+{
+    size_t len;
+    int i, rc = 0;
+
+    for (i = 1; argv[i] != NULL; i++) {
+	if ((len = varnamelen(argv[i])) == 0 || argv[i][len] != '\0') {
+	    printf("unset: `%s': not a valid identifier\n", argv[i]);
+	    rc = 1;
+	}
+	else
+	    varunset(argv[i]);
+    }
+    return rc;
+}
+/***********************
+ * End builtin commands
+ ***********************/
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * SIGCHLD, SIGINT and SIGTSTP are normally blocked and read from a
+ * signalfd, so these handlers are called by the event loop rather than
+ * in signal context. With -a they are installed as ordinary signal
+ * handlers instead, and wake the event loop through a pipe. Either
+ * way they do as little as possible: they only touch the reaped ring
+ * and a few variables, and are async-signal-safe.
+ */
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminaates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+/*
+	The handler only reaps: the PID, status and resource usage of each child are pushed into the reaped ring by reapchildren(). The job list is updated, and the notifications printed, by reapdrain(), which takes the records out of the ring in a batch. With a signalfd it is called right away; with -a the handler wakes up the event loop, which calls it.
+*/
+void sigchld_handler(int sig) 
+{
+	int olderrno = errno;
+	
+	reapchildren();
+	if(asyncsig)
+		wakeup();
+	else
+		reapdrain();
+	errno = olderrno;
+	return;
+}
+
+/*
+ * reapchildren - Reap every child that terminated or stopped into the
+ *    reaped ring, as long as the ring has room
+ */
+/*
+	Here, wait4 will check if any child process (due to -1 argument) is terminated (due to WNOHANG) or stopped (due to WUNTRACED) without pausing the parent process and will reap all its child processes. It works like waitpid, but also returns the resources used by a terminated child.
+	
+	If the ring is full the remaining children are left for reapdrain(), which reaps them once it has made room.
+*/
+static void reapchildren(void)
+{
+	struct reaprec_t *r;
+	
+	while((r = reapslot()) != NULL) {
+		if((r->pid = wait4(-1,&r->status,WNOHANG|WUNTRACED,&r->ru)) <= 0)
+			return;
+		clock_gettime(CLOCK_MONOTONIC,&r->ts);
+		reappush();
+	}
+	reapring.overflow = 1;
+}
+
+/*
+ * reapdrain - Update the job list with the records in the reaped ring
+ *    and print the notifications
+ */
+void reapdrain(void)
+{
+	struct reaprec_t *r;
+	sigset_t mask, prev;
+	
+	while(1) {
+		while((r = reappeek()) != NULL) {
+			jobreaped(r);
+			reappop();
+		}
+		if(!reapring.overflow)
+			break;
+		/* the ring was full: reap the rest here, as the only producer */
+		reapring.overflow = 0;
+		sigemptyset(&mask);
+		sigaddset(&mask,SIGCHLD);
+		sigprocmask(SIG_BLOCK,&mask,&prev);
+		reapchildren();
+		sigprocmask(SIG_SETMASK,&prev,NULL);
+	}
+	/* jobs may have ended: start the queued jobs that are now admitted */
+	if(sched.nqueued > 0)
+		schedrun();
+}
+
+/*
+ * jobreaped - Apply a record of the reaped ring to the job list
+ */
+static void jobreaped(struct reaprec_t *r)
+{
+	pid_t pid = r->pid;
+	int status = r->status; 
+	/* status contains information about the termination or stopping of the process which can be accessed using WIFEXITED, WIFSTOPPED, WIFSIGNALED, etc. */
+	struct job_t *job = getjobpid(jobs,pid); /* job owning pid */
+	int jid; /* job id of the job being considered */
+	
+	if(job == NULL) /* not one of our jobs */
+		return;
+	jid = job->jid; /* jid of the job being considered */
+	
+	/*
+		WIFSTOPPED checks if the job is stopped on receiving a signal.
+		The state of the job is then changed to ST(i.e.stopped). Every stage of a pipeline reports its stop, but the job is reported only once.
+	*/
+	if(WIFSTOPPED(status)) {
+		if(jobpgid) /* a subshell is stopped and resumed with its jobs */
+			return;
+		if(batch.maxrun && batchstopped(job->pid,status)) /* nothing could continue it */
+			return;
+		if(job->state != ST) {
+			if(job->state == FG)
+				laststatus = 128 + WSTOPSIG(status);
+			setjobstate(jobs,job,ST);
+			trace(TR_STOP,job->pid,jid,status,&r->ts);
+			printf("job [%d] (%d) stopped by signal %d\n",jid,job->pid,WSTOPSIG(status));
+			fflush(stdout);
+			ctlevent(jid,job->pid,status);
+		}
+		return;
+	}
+	
+	/*
+		Otherwise the process has terminated, normally (WIFEXITED) or on receiving a signal (WIFSIGNALED). The status of the last stage of a pipeline is the status of the job, and the job is deleted from the joblist once all of its processes have been reaped.
+	*/
+	trace(TR_EXIT,pid,jid,status,&r->ts);
+	if(pid == job->pids[job->npids-1])
+		job->status = status;
+	addusage(&job->usage,&r->ru);
+	if(--job->nlive > 0) {
+		deletejobpid(jobs,pid);
+		return;
+	}
+	pid = job->pid;
+	status = job->status;
+	job->usage.end = r->ts;
+	if(job->state == FG) { /* for the time prefix, $? and lists */
+		fgusage = job->usage;
+		laststatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		if(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+			listabort = 1;
+	}
+	else /* for the wait builtin */
+		jobdone(pid,jid,status);
+	deletejob(jobs,pid);
+	trace(TR_REAP,pid,jid,status,NULL);
+	ctlevent(jid,pid,status);
+	if(batch.maxrun && batchdone(pid,status)) /* reported with the line's output */
+		return;
+	if(WIFSIGNALED(status)) {
+		printf("job [%d] (%d) terminated by signal %d\n",jid,pid,WTERMSIG(status));
+		fflush(stdout);
+	}
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+/*
+	The process group of the foreground job is kept in fgpgid by waitfg(), so the handler does not have to look at the job list. A SIGINT signal is sent to all processes in the foreground process group using (-pid) argument in the kill() function.
+	
+	Each child process has process ID = PID due to call to setpgid() function in eval.
+*/
+void sigint_handler(int sig) 
+{
+	int olderrno = errno;
+	pid_t pid = fgpgid; /* PID of the foreground job */
+	
+	if(pid == 0) /* no foreground job: interrupt a builtin such as sleep */
+		interrupted = 1;
+	/* SIGINT is sent to all processes with group process ID = pid, i.e. processes in the foreground process group. (The job may have just finished.) */
+	else if(kill(-pid, SIGINT) < 0 && errno != ESRCH)
+		unix_error("kill error\n"); 
+	if(asyncsig)
+		wakeup();
+	errno = olderrno;
+	return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+/*
+	A SIGTSTP signal is sent to all processes in the foreground process group (fgpgid) using (-pid) argument in the kill() function.
+	
+	The state of the job is changed to ST(i.e. stopped) by sigchld_handler when the stop is reported, which is also where the message is printed.
+	
+	Each child process has process ID = PID due to call to setpgid() function in eval.
+*/
+void sigtstp_handler(int sig) 
+{
+	int olderrno = errno;
+	pid_t pid = fgpgid; /* PID of the foreground job */
+	
+	/* SIGTSTP is sent to all processes with group process ID = pid, i.e. processes in the foreground process group. */
+	if(pid != 0 && kill(-pid,SIGTSTP) < 0 && errno != ESRCH)
+		unix_error("kill error\n"); 
+	errno = olderrno;
+	return;
+}
+
+/*
+ * The reaped ring is a single-producer, single-consumer queue of the
+ * children reaped by sigchld_handler. The producer only moves head and
+ * the consumer only moves tail, both atomically, so a record can be
+ * pushed from a signal handler while the event loop is taking records
+ * out, without any lock.
+ */
+
+/* reapslot - Return the next free record of the ring, NULL if it is full */
+static struct reaprec_t *reapslot(void)
+{
+	unsigned int head = atomic_load_explicit(&reapring.head,memory_order_relaxed);
+	
+	if(head - atomic_load_explicit(&reapring.tail,memory_order_acquire) == REAPRING)
+		return NULL;
+	return &reapring.recs[head & (REAPRING-1)];
+}
+
+/* reappush - Publish the record returned by reapslot */
+static void reappush(void)
+{
+	atomic_fetch_add_explicit(&reapring.head,1,memory_order_release);
+}
+
+/* reappeek - Return the oldest record of the ring, NULL if it is empty */
+static struct reaprec_t *reappeek(void)
+{
+	unsigned int tail = atomic_load_explicit(&reapring.tail,memory_order_relaxed);
+	
+	if(tail == atomic_load_explicit(&reapring.head,memory_order_acquire))
+		return NULL;
+	return &reapring.recs[tail & (REAPRING-1)];
+}
+
+/* reappop - Release the record returned by reappeek */
+static void reappop(void)
+{
+	atomic_fetch_add_explicit(&reapring.tail,1,memory_order_release);
+}
+
+/* wakeup - Make the event loop run (with -a) */
+static void wakeup(void)
+{
+	char c = 0;
+	
+	if(write(wakefd,&c,1) < 0) /* full: the loop will wake up anyway */
+		return;
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/*********************
+ * Command line lexer
+ *********************/
+
+/*
+ * lexline splits a command line into words, the operators |, &, ;, &&
+ * and ||, and redirections in a single pass. The line is copied once, with a single memcpy,
+ * into a growable buffer and the words are cut out of the copy in
+ * place: a word without quotes only needs a NUL written after it, and
+ * removing quotes and backslashes only ever moves text to the left.
+ * argv points straight into that buffer. Single quotes keep everything
+ * literally, double quotes keep everything except \", \\, \$ and \`,
+ * and a backslash outside quotes escapes the next character. There is
+ * no limit on the length of the line or on the number of words.
+ *
+ * A $ that starts an expansion outside single quotes is replaced by
+ * VARMARK, or VARQMARK within double quotes, and the word is expanded
+ * by varexpand when its job is run, so a line, or the script cache,
+ * holds the same tokens whatever the values of the variables. The
+ * value of an expansion is not split into words, but a word that comes
+ * out empty is dropped unless one of its expansions was quoted.
+ *
+ * An unquoted { or } alone in the place of a command opens or closes a
+ * group, as in sh: } must follow a ; or & and nothing but an operator
+ * may follow it. lexline checks that the groups are balanced, so the
+ * parser (lexjob) never has to.
+ *
+ * A redirection, [n]<, [n]>, [n]>>, [n]>&m, [n]<&m or [n]<<<, is a
+ * T_REDIR token, with its operator and descriptor packed in the type
+ * so that the script cache keeps them, followed by its word.
+ */
+
+/* Character classes used by the lexer */
+#define C_WORD  0   /* ordinary word character */
+#define C_SPACE 1   /* separates words */
+#define C_OP    2   /* operator: | & ; < > */
+#define C_QUOTE 3   /* ' " \ $ */
+#define C_END   4   /* the NUL after the line */
+
+static const unsigned char lexclass[256] = {
+    ['\0'] = C_END,
+    [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE, ['\r'] = C_SPACE,
+    ['|'] = C_OP, ['&'] = C_OP, [';'] = C_OP, ['<'] = C_OP, ['>'] = C_OP,
+    ['\''] = C_QUOTE, ['"'] = C_QUOTE, ['\\'] = C_QUOTE, ['$'] = C_QUOTE,
+};
+
+/* lexvarstart - Return 1 if a $ followed by c is expanded */
+static int lexvarstart(int c)
+{
+    return isalpha(c) || c == '_' || c == '{' || c == '?' || c == '$';
+}
+
+/* lexgrow - Make room for more tokens plus the terminating NULL */
+static void lexgrow(struct lexer_t *lx)
+{
+    lx->tokcap = lx->tokcap ? 2 * lx->tokcap : 64;
+    if ((lx->argv = realloc(lx->argv, lx->tokcap * sizeof(char *))) == NULL ||
+	(lx->type = realloc(lx->type, lx->tokcap * sizeof(int))) == NULL ||
+	(lx->off = realloc(lx->off, lx->tokcap * sizeof(size_t))) == NULL)
+	unix_error("lexline error");
+}
+
+/* lexop - Return the type of the operator c, followed by next, and its length */
+static int lexop(int c, int next, int *len)
+{
+    *len = c != ';' && next == c ? 2 : 1;
+    if (c == '|')
+	return *len == 2 ? T_OR : T_PIPE;
+    if (c == '&')
+	return *len == 2 ? T_AND : T_AMP;
+    return T_SEMI;
+}
+
+/* 
+ * lexredir - Return the type of the redirection of descriptor fd (-1:
+ *    the default one) starting with c, followed by next, and its length
+ */
+static int lexredir(int c, const unsigned char *next, int fd, int *len)
+{
+    int op;
+
+    *len = 1;
+    if (c == '<' && next[0] == '<' && next[1] == '<')
+	op = R_HERE, *len = 3;
+    else if (next[0] == '&')
+	op = R_DUP, *len = 2;
+    else if (c == '>' && next[0] == '>')
+	op = R_APPEND, *len = 2;
+    else
+	op = c == '<' ? R_IN : R_OUT;
+    if (fd < 0)
+	fd = c == '<' ? 0 : 1;
+    return T_REDIR | op << 4 | fd << 8;
+}
+
+static const char *lextoken[] = { "", "|", "&", ";", "&&", "||", "{", "}" };
+
+/* lexerror - Report a syntax error at token tok */
+static int lexerror(struct lexer_t *lx, const char *tok)
+{
+    if (!lx->quiet)
+	printf("syntax error near unexpected token `%s'\n", tok);
+    return -1;
+}
+
+/* 
+ * lexline - Split the len bytes of cmdline into tokens. Returns the
+ *    number of tokens, 0 for an empty line, or -1 after reporting a
+ *    syntax error.
+ */
+int lexline(struct lexer_t *lx, const char *cmdline, size_t len)
+{
+    unsigned char *p, *out, *q;
+    int ntok = 0, words = 0; /* words since the last operator */
+    int depth = 0, closed = 0; /* groups open, a } was just read */
+    int target = 0, redirword; /* the next word, this one, is that of a redirection */
+    int c, t, n, fd;
+    char **argv = lx->argv;
+    int *type = lx->type;
+    size_t *off = lx->off;
+
+    if (lx->bufcap < len + 1) {
+	free(lx->buf);
+	lx->bufcap = len + 1;
+	if ((lx->buf = malloc(lx->bufcap)) == NULL)
+	    unix_error("lexline error");
+    }
+    memcpy(lx->buf, cmdline, len);
+    lx->buf[len] = '\0';
+    p = (unsigned char *)lx->buf;
+    lx->line = cmdline;
+    lx->njobs = 0;
+
+    while (1) {
+	/* skip to the next token */
+	while (lexclass[*p] == C_SPACE)
+	    p++;
+	if (*p == '\0')
+	    break;
+	if (ntok + 2 > lx->tokcap) {
+	    lexgrow(lx);
+	    argv = lx->argv, type = lx->type, off = lx->off;
+	}
+	off[ntok] = (char *)p - lx->buf;
+
+	/* a redirection, maybe with the descriptor (up to 4 digits) in
+	 * front; a longer run of digits is a word of its own */
+	for (q = p, fd = 0; isdigit(*q); q++)
+	    if (q - p < 4)
+		fd = 10 * fd + *q - '0';
+	if ((*q == '<' || *q == '>') && (q > p ? q - p <= 4 : lexclass[*p] == C_OP)) {
+	    if (target)
+		return lexerror(lx, *q == '<' ? "<" : ">");
+	    argv[ntok] = NULL;
+	    type[ntok++] = lexredir(*q, q + 1, q > p ? fd : -1, &n);
+	    p = q + n;
+	    target = 1;
+	    continue;
+	}
+
+	if (lexclass[*p] == C_OP) {
+	    t = lexop(p[0], p[1], &n);
+	    if (words == 0 || target)
+		return lexerror(lx, lextoken[t]);
+	    argv[ntok] = NULL;
+	    type[ntok++] = t;
+	    if (t != T_PIPE)
+		lx->njobs++;
+	    p += n;
+	    words = closed = 0;
+	    continue;
+	}
+
+	/* { or } in the place of a command */
+	if (words == 0 && !target && (*p == '{' || *p == '}') &&
+	    lexclass[p[1]] != C_WORD && lexclass[p[1]] != C_QUOTE) {
+	    if (*p == '{')
+		depth++;
+	    else if (depth == 0 || (type[ntok-1] != T_SEMI && type[ntok-1] != T_AMP))
+		return lexerror(lx, "}");
+	    else {
+		depth--;
+		words = closed = 1;
+	    }
+	    argv[ntok] = NULL;
+	    type[ntok++] = *p++ == '{' ? T_LBRACE : T_RBRACE;
+	    continue;
+	}
+
+	/* a word: cut it out of the buffer, removing quotes in place */
+	argv[ntok] = (char *)p;
+	type[ntok++] = T_WORD;
+	words++;
+	redirword = target;     /* which may follow a } */
+	target = 0;
+	out = p;
+	while (1) {
+	    for (q = p; lexclass[*q] == C_WORD; q++)
+		;
+	    if (out != p)
+		memmove(out, p, q - p);
+	    out += q - p;
+	    p = q;
+	    if (*p == '\'') {
+		if ((q = (unsigned char *)strchr((char *)p + 1, '\'')) == NULL)
+		    return lexerror(lx, "'");
+		memmove(out, p + 1, q - p - 1);
+		out += q - p - 1;
+		p = q + 1;
+	    }
+	    else if (*p == '"') {
+		for (p++; *p != '"' && *p != '\0'; *out++ = *p++) {
+		    if (*p == '\\' && p[1] != '\0' && strchr("\"\\$`", p[1]))
+			p++;
+		    else if (*p == '$' && lexvarstart(p[1]))
+			*p = VARQMARK;
+		}
+		if (*p++ == '\0')
+		    return lexerror(lx, "\"");
+	    }
+	    else if (*p == '$') {
+		*out++ = lexvarstart(p[1]) ? VARMARK : '$';
+		p++;
+	    }
+	    else if (*p == '\\') {
+		if (*++p == '\n')      /* a trailing backslash is dropped */
+		    p++;
+		else if (*p != '\0')
+		    *out++ = *p++;
+	    }
+	    else
+		break;
+	}
+	/* the NUL may land on the delimiter, so look at it first */
+	c = *p;
+	*out = '\0';
+	if (closed && !redirword) /* } followed by a word */
+	    return lexerror(lx, argv[ntok-1]);
+	if (c == '\0')
+	    break;
+	if (c == '<' || c == '>') {
+	    if (ntok + 2 > lx->tokcap) {
+		lexgrow(lx);
+		argv = lx->argv, type = lx->type, off = lx->off;
+	    }
+	    off[ntok] = (char *)p - lx->buf;
+	    argv[ntok] = NULL;
+	    type[ntok++] = lexredir(c, p + 1, -1, &n);
+	    target = 1;
+	    p += n - 1;
+	}
+	else if (lexclass[c] == C_OP) {
+	    if (ntok + 2 > lx->tokcap) {
+		lexgrow(lx);
+		argv = lx->argv, type = lx->type, off = lx->off;
+	    }
+	    off[ntok] = (char *)p - lx->buf;
+	    argv[ntok] = NULL;
+	    type[ntok++] = t = lexop(c, p[1], &n);
+	    if (t != T_PIPE)
+		lx->njobs++;
+	    words = closed = 0;
+	    p += n - 1;
+	}
+	p++;
+    }
+    if (ntok > 0 && (type[ntok-1] == T_PIPE || type[ntok-1] == T_AND ||
+		     type[ntok-1] == T_OR))
+	return lexerror(lx, "newline");
+    if (depth > 0 || target)
+	return lexerror(lx, "newline");
+    if (words > 0)
+	lx->njobs++;
+
+    if (ntok + 1 > lx->tokcap) {
+	lexgrow(lx);
+	argv = lx->argv, type = lx->type, off = lx->off;
+    }
+    argv[ntok] = NULL;
+    type[ntok] = T_WORD;
+    off[ntok] = len;
+    trace(TR_PARSE, 0, 0, ntok, NULL);
+    return lx->ntok = ntok;
+}
+
+/* lexclose - Return the index of the } closing the group opened at token i */
+static int lexclose(struct lexer_t *lx, int i)
+{
+    int depth = 0;
+
+    for (;; i++)
+	if (lx->type[i] == T_LBRACE)
+	    depth++;
+	else if (lx->type[i] == T_RBRACE && --depth == 0)
+	    return i;
+}
+
+/* lexstage - Add a stage to pl */
+static void lexstage(struct pipeline_t *pl, char **argv)
+{
+    if (pl->ncmds == pl->cmdcap) {
+	pl->cmdcap = pl->cmdcap ? 2 * pl->cmdcap : 8;
+	if ((pl->cmds = realloc(pl->cmds, pl->cmdcap * sizeof(char **))) == NULL)
+	    unix_error("lexjob error");
+    }
+    pl->cmds[pl->ncmds++] = argv;
+}
+
+/* lexgroup - Add a stage running tokens start..end-1 of lx in a subshell */
+static void lexgroup(struct pipeline_t *pl, struct lexer_t *lx, int start, int end)
+{
+    struct group_t *g;
+
+    if (pl->ngroups == pl->groupcap) {
+	pl->groupcap = pl->groupcap ? 2 * pl->groupcap : 4;
+	if ((pl->groups = realloc(pl->groups, pl->groupcap * sizeof(*g))) == NULL)
+	    unix_error("lexjob error");
+    }
+    g = &pl->groups[pl->ngroups++];
+    g->argv[0] = groupword;
+    g->argv[1] = NULL;
+    g->lx = lx;
+    g->start = start;
+    g->end = end;
+    lexstage(pl, NULL);         /* set once groups stops moving */
+}
+
+/* 
+ * lexgroupend - If tokens i..end-1 of lx are a group and its
+ *    redirections, return the index of its }, else -1
+ */
+int lexgroupend(struct lexer_t *lx, int i, int end)
+{
+    int close, k;
+
+    if (lx->type[i] != T_LBRACE)
+	return -1;
+    close = lexclose(lx, i);
+    for (k = close + 1; k < end && ISREDIR(lx->type[k]); k += 2)
+	;
+    return k == end ? close : -1;
+}
+
+/* lexredirs - Add the redirections in tokens i..end-1 of lx to stage of pl */
+void lexredirs(struct pipeline_t *pl, struct lexer_t *lx, int i, int end, int stage)
+{
+    struct redir_t *r;
+
+    for (; i < end; i++) {
+	if (!ISREDIR(lx->type[i]))
+	    continue;
+	if (pl->nredirs == pl->redircap) {
+	    pl->redircap = pl->redircap ? 2 * pl->redircap : 8;
+	    if ((pl->redirs = realloc(pl->redirs, pl->redircap * sizeof(*r))) == NULL)
+		unix_error("lexjob error");
+	}
+	r = &pl->redirs[pl->nredirs++];
+	r->stage = stage;
+	r->fd = REDIRFD(lx->type[i]);
+	r->op = REDIROP(lx->type[i]);
+	r->word = lx->argv[++i];
+	r->src = r->saved = -1;
+    }
+}
+
+/* 
+ * lexjob - Get the job that starts at token i and ends before token
+ *    end, at the next ; or & outside a group: the argv of each stage of
+ *    the pipeline and its redirections, whether it runs in the
+ *    background, its tokens and its text. A stage that is a group is run
+ *    by a subshell, and so is the whole job if it is an and-or list or a
+ *    single group; such a job has list set, as the shell runs it itself
+ *    in the foreground (runlist). argv points into lx->argv, except for
+ *    a stage with redirections, whose words are copied to pl->words.
+ *    Returns the token after the job.
+ */
+int lexjob(struct lexer_t *lx, int i, int end, struct pipeline_t *pl)
+{
+    int depth = 0, stage = i, k, g, from, nwords = 0;
+    char **w;
+
+    pl->ncmds = 0;
+    pl->ngroups = 0;
+    pl->nredirs = 0;
+    pl->list = 0;
+    pl->start = i;
+    pl->text = lx->line + lx->off[i];
+    for (; i < end; i++) {
+	if (lx->type[i] == T_LBRACE)
+	    depth++;
+	else if (lx->type[i] == T_RBRACE)
+	    depth--;
+	else if (depth > 0)
+	    ;
+	else if (lx->type[i] == T_AMP || lx->type[i] == T_SEMI)
+	    break;
+	else if (lx->type[i] == T_AND || lx->type[i] == T_OR)
+	    pl->list = 1;
+    }
+    pl->end = i;
+    pl->bg = i < end && lx->type[i] == T_AMP;
+    if (lexgroupend(lx, pl->start, pl->end) >= 0)
+	pl->list = 1;
+
+    /* room for every copied argv, so that the pointers to it stay valid */
+    if (pl->wordcap < 2 * (pl->end - pl->start) + 2) {
+	pl->wordcap = 2 * (pl->end - pl->start) + 2;
+	if ((pl->words = realloc(pl->words, pl->wordcap * sizeof(char *))) == NULL)
+	    unix_error("lexjob error");
+    }
+
+    /* the stages, split at the | outside groups */
+    if (pl->list)
+	lexgroup(pl, lx, pl->start, pl->end);
+    else
+	for (; stage < pl->end; stage = k + 1) {
+	    from = stage;
+	    if (lx->type[stage] == T_LBRACE) {
+		from = lexclose(lx, stage) + 1;
+		lexgroup(pl, lx, stage + 1, from - 1);
+	    }
+	    for (k = from; k < pl->end && lx->type[k] != T_PIPE; k++)
+		if (ISREDIR(lx->type[k]))
+		    k++;
+	    lexredirs(pl, lx, from, k, pl->ncmds - (from != stage));
+	    if (from != stage)
+		;
+	    else if (pl->nredirs == 0 || pl->redirs[pl->nredirs-1].stage != pl->ncmds)
+		lexstage(pl, &lx->argv[stage]);
+	    else {
+		for (w = pl->words + nwords; from < k; from++)
+		    if (ISREDIR(lx->type[from]))
+			from++;
+		    else
+			pl->words[nwords++] = lx->argv[from];
+		pl->words[nwords++] = NULL;
+		lexstage(pl, w);
+	    }
+	}
+    for (k = g = 0; k < pl->ncmds; k++)
+	if (pl->cmds[k] == NULL)
+	    pl->cmds[k] = pl->groups[g++].argv;
+
+    if (i < end)                /* the text includes the & or ; */
+	i++;
+    pl->textlen = lx->line + lx->off[i] - pl->text;
+    return i;
+}
+
+/* 
+ * nextpipeline - Get the job that starts at token *tok (see lexjob).
+ *    Returns 0 when there are no more jobs.
+ */
+int nextpipeline(struct lexer_t *lx, int *tok, struct pipeline_t *pl)
+{
+    if (*tok >= lx->ntok)
+	return 0;
+    *tok = lexjob(lx, *tok, lx->ntok, pl);
+    return 1;
+}
+
+/* 
+ * pipelinetext - Return the text of a job on a line with several jobs,
+ *    ending in a newline like a line of its own
+ */
+char *pipelinetext(struct pipeline_t *pl)
+{
+    static char *buf;
+    static size_t cap;
+    size_t n = pl->textlen;
+
+    while (n > 0 && lexclass[(unsigned char)pl->text[n-1]] == C_SPACE)
+	n--;
+    if (n + 2 > cap) {
+	cap = n + 2;
+	if ((buf = realloc(buf, cap)) == NULL)
+	    unix_error("pipelinetext error");
+    }
+    memcpy(buf, pl->text, n);
+    buf[n] = '\n';
+    buf[n+1] = '\0';
+    return buf;
+}
+/*************************
+ * End command line lexer
+ *************************/
+
+/***************
+ * Redirections
+ ***************/
+
+/*
+ * The redirections of a stage are a plan carried out in order. The
+ * shell opens the files, and makes a here-string a memfd holding the
+ * string, before the stage starts (redirsetup); an external command gets
+ * them as posix_spawn() file actions and a forked child dup2()s them
+ * itself (redirdup), after the pipes. A builtin, or a group, run by the
+ * shell gets them on the shell's own descriptors, saved first and put
+ * back when it returns (redirsave, redirrestore), so it never forks.
+ * The files are kept at descriptors 10 and up (fdhigh), out of the way of
+ * the descriptors a command line redirects, like every descriptor the
+ * shell keeps open for itself, so that a builtin's redirection never
+ * lands on the event loop's.
+ */
+
+/* redirhere - Return a memfd holding word and a newline, at its start */
+static int redirhere(const char *word)
+{
+    struct iovec iov[2] = {
+	{ (void *)word, strlen(word) }, { "\n", 1 }
+    };
+    int fd;
+
+    if ((fd = memfd_create("tsh-here", MFD_CLOEXEC)) < 0)
+	return -1;
+    if (writev(fd, iov, 2) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/* 
+ * redirsetup - Open what the n redirections r need, setting their src.
+ *    Returns -1, with nothing left open, after reporting an error.
+ */
+int redirsetup(struct redir_t *r, int n)
+{
+    static const int flags[] = {
+	[R_IN] = O_RDONLY,
+	[R_OUT] = O_WRONLY|O_CREAT|O_TRUNC,
+	[R_APPEND] = O_WRONLY|O_CREAT|O_APPEND,
+    };
+    char *end;
+    long fd;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+	if (r[i].op == R_DUP) {
+	    r[i].src = -1;
+	    if (strcmp(r[i].word, "-") == 0)
+		continue;
+	    /* a descriptor that is open, or that a redirection before opens */
+	    fd = strtol(r[i].word, &end, 10);
+	    for (j = 0; j < i && r[j].fd != fd; j++)
+		;
+	    if (isdigit((unsigned char)*r[i].word) && *end == '\0' && fd <= INT_MAX &&
+		(j < i || fcntl(fd, F_GETFD) >= 0)) {
+		r[i].src = fd;
+		continue;
+	    }
+	    errno = EBADF;
+	}
+	else if (r[i].op == R_HERE)
+	    r[i].src = fdhigh(redirhere(r[i].word));
+	else
+	    r[i].src = fdhigh(open(r[i].word, flags[r[i].op]|O_CLOEXEC, 0666));
+	if (r[i].src < 0) {
+	    printf("%s: %s\n", r[i].word, strerror(errno));
+	    redirclose(r, i);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* redirclose - Close what redirsetup opened for the n redirections r */
+void redirclose(struct redir_t *r, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	if (r[i].op != R_DUP && r[i].src >= 0) {
+	    close(r[i].src);
+	    r[i].src = -1;
+	}
+}
+
+/* redirdup - Make the n redirections r, set up, in a child */
+void redirdup(struct redir_t *r, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	if (r[i].src < 0)
+	    close(r[i].fd);
+	else if (r[i].src == r[i].fd)
+	    fcntl(r[i].fd, F_SETFD, 0);
+	else
+	    dup2(r[i].src, r[i].fd);
+}
+
+/* 
+ * redirsave - Make the n redirections r in the shell, saving the
+ *    descriptors they replace. Returns -1, with nothing changed, after
+ *    reporting an error.
+ */
+int redirsave(struct redir_t *r, int n)
+{
+    int i, err;
+
+    if (n == 0)
+	return 0;
+    fflush(stdout);             /* what was printed goes where it was meant to */
+    if (redirsetup(r, n) < 0)
+	return -1;
+    for (i = 0; i < n; i++) {
+	r[i].saved = fcntl(r[i].fd, F_DUPFD_CLOEXEC, 10);
+	if (r[i].src < 0)
+	    close(r[i].fd);
+	else if (dup2(r[i].src, r[i].fd) < 0) {
+	    err = errno;
+	    redirrestore(r, i + 1);
+	    redirclose(r, n);
+	    printf("%s: %s\n", r[i].word, strerror(err));
+	    return -1;
+	}
+    }
+    redirclose(r, n);
+    return 0;
+}
+
+/* redirrestore - Undo the n redirections r made by redirsave */
+void redirrestore(struct redir_t *r, int n)
+{
+    int i;
+
+    if (n == 0)
+	return;
+    fflush(stdout);
+    for (i = n - 1; i >= 0; i--) {
+	if (r[i].saved >= 0) {
+	    dup2(r[i].saved, r[i].fd);
+	    close(r[i].saved);
+	}
+	else
+	    close(r[i].fd);
+	r[i].saved = -1;
+    }
+}
+/*******************
+ * End redirections
+ *******************/
+
+/*************
+ * Event loop
+ *************/
+
+/*
+ * The shell waits in a single epoll instance that watches a signalfd
+ * for SIGCHLD, SIGINT and SIGTSTP and, while the shell wants a command
+ * line, standard input. Reaping, foreground waits and input are thus
+ * serialized in one place and no signal handler races with the job
+ * table. stdin is registered EPOLLONESHOT and only re-armed when the
+ * shell is about to read, so input typed ahead does not wake up waitfg.
+ */
+
+/* sigevent - Dispatch the signals read from the signalfd */
+static void sigevent(struct evsrc_t *src, unsigned int events)
+{
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int i, chld = 0;
+
+    while ((n = read(src->fd, si, sizeof(si))) > 0) {
+	for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+	    switch (si[i].ssi_signo) {
+	    case SIGCHLD:       /* one reaping pass handles them all */
+		chld = 1;
+		break;
+	    case SIGINT:
+		sigint_handler(SIGINT);
+		break;
+	    case SIGTSTP:
+		sigtstp_handler(SIGTSTP);
+		break;
+	    }
+	}
+    }
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+	unix_error("signalfd read error");
+    if (chld)
+	sigchld_handler(SIGCHLD);
+}
+
+/* wakeevent - Handle the children the signal handlers reaped (-a) */
+static void wakeevent(struct evsrc_t *src, unsigned int events)
+{
+    char buf[64];
+
+    while (read(src->fd, buf, sizeof(buf)) > 0)
+	;
+    reapdrain();
+}
+
+/* inputevent - Note that stdin became readable */
+static void inputevent(struct evsrc_t *src, unsigned int events)
+{
+    input.ready = 1;
+}
+
+/* evadd - Start watching src->fd for events */
+int evadd(struct evsrc_t *src, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev);
+}
+
+/* evmod - Change the events watched for on src->fd */
+int evmod(struct evsrc_t *src, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = src;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+/* 
+ * evdel - Stop watching src->fd. Closing it is not enough while a
+ *    child that has not exec'd yet shares the open file.
+ */
+int evdel(struct evsrc_t *src)
+{
+    return epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/* 
+ * initevents - Block the signals handled by the event loop and create
+ *    the epoll instance, the signalfd and the event source for infd,
+ *    where command lines are read from.
+ */
+void initevents(int infd)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+
+    if ((epfd = fdhigh(epoll_create1(EPOLL_CLOEXEC))) < 0)
+	unix_error("epoll_create error");
+    if (asyncsig) {
+	int fds[2];
+
+	/* the handlers reap into reapring and write to the pipe; the
+	 * job table is only touched when the event loop drains it */
+	if (pipe2(fds, O_NONBLOCK|O_CLOEXEC) < 0 ||
+	    (fds[0] = fdhigh(fds[0])) < 0 || (fds[1] = fdhigh(fds[1])) < 0)
+	    unix_error("pipe error");
+	wakefd = fds[1];
+	sigsrc.fd = fds[0];
+	sigsrc.handler = wakeevent;
+	if (sigprocmask(SIG_BLOCK, NULL, &origmask) < 0)
+	    unix_error("sigprocmask error");
+	Signal(SIGCHLD, sigchld_handler);
+	Signal(SIGINT, sigint_handler);
+	Signal(SIGTSTP, sigtstp_handler);
+    }
+    else {
+	if (sigprocmask(SIG_BLOCK, &mask, &origmask) < 0)
+	    unix_error("sigprocmask error");
+	if ((sigsrc.fd = fdhigh(signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC))) < 0)
+	    unix_error("signalfd error");
+	sigsrc.handler = sigevent;
+    }
+    if (evadd(&sigsrc, EPOLLIN) < 0)
+	unix_error("epoll_ctl error");
+
+    /* regular files cannot be polled; they are always readable */
+    input.src.fd = infd;
+    input.src.handler = inputevent;
+    if (evadd(&input.src, EPOLLIN|EPOLLONESHOT) == 0)
+	input.pollable = 1;
+    else if (errno != EPERM)
+	unix_error("epoll_ctl error");
+}
+
+/* 
+ * initsubshell - Give a subshell (see spawngroup) an event loop, a
+ *    job table and signals of its own; mask is the signal mask the
+ *    shell started with
+ */
+void initsubshell(sigset_t *mask)
+{
+    struct ctlclient_t *c;
+    sigset_t chld;
+
+    /* the event sources, the queue, the rings and the fork server
+     * belong to the shell */
+    close(epfd);
+    close(sigsrc.fd);
+    if (wakefd >= 0)
+	close(wakefd);
+    wakefd = -1;
+    asyncsig = 0;
+    if (zygfd >= 0)
+	close(zygfd);
+    zygfd = -1;
+    if (ctl.src.fd >= 0)
+	close(ctl.src.fd);
+    for (c = ctl.clients; c != NULL; c = c->next)
+	close(c->src.fd);
+    ctl.src.fd = -1;
+    ctl.clients = NULL;
+    ctl.nsubs = 0;
+    sched.maxrun = 0;
+    sched.maxload = 0;
+    sched.minmem = 0;
+    sched.nqueued = 0;
+    sched.timer.fd = -1;
+    capture.size = 0;
+    capture.rings = NULL;
+    batch.maxrun = 0;
+    pin.policy = PIN_OFF;   /* its jobs share the CPUs it was given */
+    tracebuf.fd = -1;
+    ed.on = 0;
+    initjobs(jobs);
+    nextjid = 1;
+    fgpgid = 0;
+    listabort = 0;
+    jobpgid = getpgrp();
+
+    /* ctrl-c and ctrl-z stop the subshell with its commands */
+    Signal(SIGCHLD, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_SETMASK, mask, NULL) < 0 ||
+	sigprocmask(SIG_BLOCK, &chld, NULL) < 0)
+	unix_error("sigprocmask error");
+    if ((epfd = fdhigh(epoll_create1(EPOLL_CLOEXEC))) < 0)
+	unix_error("epoll_create error");
+    if ((sigsrc.fd = fdhigh(signalfd(-1, &chld, SFD_NONBLOCK|SFD_CLOEXEC))) < 0)
+	unix_error("signalfd error");
+    sigsrc.handler = sigevent;
+    if (evadd(&sigsrc, EPOLLIN) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/* 
+ * evwait - Wait up to timeout milliseconds (-1: forever, 0: just poll)
+ *    for events and dispatch them
+ */
+void evwait(int timeout)
+{
+    struct epoll_event ev[MAXEVENTS];
+    struct evsrc_t *src;
+    int i, n;
+
+    /* write out the trace while there is nothing else to do */
+    if (timeout != 0 && tracebuf.count > 0)
+	traceflush();
+    if ((n = epoll_wait(epfd, ev, MAXEVENTS, timeout)) < 0) {
+	if (errno == EINTR)
+	    return;
+	unix_error("epoll_wait error");
+    }
+    for (i = 0; i < n; i++) {
+	src = ev[i].data.ptr;
+	src->handler(src, ev[i].events);
+    }
+}
+
+/* 
+ * readcmdline - Return the next line of input, of any length and
+ *    ending in a newline, running the event loop while no input is
+ *    available. The line is terminated in place in the input buffer and
+ *    is valid until the next call. Returns NULL at end of file.
+ */
+char *readcmdline(void)
+{
+    char *line, *nl;
+    ssize_t rc;
+
+    if (input.cap == 0) {
+	input.cap = 64 * 1024;
+	if ((input.buf = malloc(input.cap + 2)) == NULL)
+	    unix_error("readcmdline error");
+    }
+    else if (input.pos < input.len)
+	input.buf[input.pos] = input.saved;  /* undo the last line's NUL */
+
+    while (1) {
+	line = input.buf + input.pos;
+	nl = memchr(input.buf + input.scan, '\n', input.len - input.scan);
+	if (nl == NULL && input.eof && input.len > input.pos) {
+	    nl = input.buf + input.len;     /* last line without a newline */
+	    *nl = '\n';
+	    input.len++;
+	}
+	if (nl != NULL) {
+	    input.pos = input.scan = nl - input.buf + 1;
+	    input.saved = input.buf[input.pos];
+	    input.buf[input.pos] = '\0';     /* the spare bytes at the end */
+	    trace(TR_READ, 0, 0, 0, NULL);
+	    return line;
+	}
+	if (input.eof)
+	    return NULL;
+	fflush(stdout);         /* the driver may wait for it before writing */
+
+	/* keep the partial line at the start of a buffer with room to read */
+	input.len -= input.pos;
+	memmove(input.buf, line, input.len);
+	input.scan = input.len;
+	input.pos = 0;
+	if (input.len == input.cap) {
+	    input.cap *= 2;
+	    if ((input.buf = realloc(input.buf, input.cap + 2)) == NULL)
+		unix_error("readcmdline error");
+	}
+	if (input.pollable) {
+	    input.ready = 0;
+	    if (evmod(&input.src, EPOLLIN|EPOLLONESHOT) < 0)
+		unix_error("epoll_ctl error");
+	    while (!input.ready)
+		evwait(-1);
+	}
+	rc = read(input.src.fd, input.buf + input.len, input.cap - input.len);
+	if (rc < 0 && errno != EINTR && errno != EAGAIN)
+	    unix_error("read error");
+	if (rc == 0)
+	    input.eof = 1;
+	else if (rc > 0)
+	    input.len += rc;
+    }
+}
+/*****************
+ * End event loop
+ *****************/
+
+/*****************
+ * Fork server
+ *****************/
+
+/*
+ * With -z the shell forks a small helper, the fork server, before it
+ * allocates anything, and sends it a request for every command it
+ * starts: the path, argv, environment, process group and signal mask,
+ * with the standard input, output and error passed as SCM_RIGHTS
+ * ancillary data. The helper creates the child with
+ * clone(CLONE_PARENT), so the child is a child of the shell and is
+ * reaped by sigchld_handler like any other, and executes the command.
+ * The helper stays as small as the shell was at startup, so the cost
+ * of creating a process does not grow with the shell.
+ *
+ * The helper waits for the exec on a close-on-exec pipe before it
+ * answers, so the reply, like posix_spawn(), tells whether the command
+ * could be executed. The helper is in a process group of its own, so
+ * ctrl-c and ctrl-z at the terminal do not reach it, and it exits when
+ * the shell closes its end of the socket.
+ */
+
+struct zygreq_t {           /* a spawn request; the strings follow */
+    pid_t pgid;             /* process group, 0 for a new one */
+    int argc, envc;         /* number of arguments and variables */
+    size_t len;             /* bytes of strings: path, argv, environment */
+    sigset_t mask;          /* signal mask of the child */
+};
+struct zygrep_t {           /* the reply */
+    pid_t pid;              /* the child, 0 if it could not be created */
+    int err;                /* errno of the failure */
+};
+
+/* zygread - Read exactly n bytes, returning 0 at end of file */
+static int zygread(int fd, void *buf, size_t n)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = read(fd, buf, n)) <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf = (char *)buf + rc;
+	n -= rc;
+    }
+    return 1;
+}
+
+/* zygwrite - Write exactly n bytes */
+static int zygwrite(int fd, const void *buf, size_t n)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = write(fd, buf, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf = (const char *)buf + rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+/* zygchild - Run a request in the new child; does not return */
+static void zygchild(struct zygreq_t *req, int *fds, char *path, char **argv, 
+		     char **envp, int errfd)
+{
+    int i, err;
+
+    setpgid(0, req->pgid);
+    for (i = 0; i < 3; i++)
+	if (fds[i] != i && dup2(fds[i], i) < 0)
+	    goto fail;
+    sigprocmask(SIG_SETMASK, &req->mask, NULL);
+    execve(path, argv, envp);
+ fail:
+    err = errno;
+    zygwrite(errfd, &err, sizeof(err));
+    _exit(127);
+}
+
+/* zygserve - The fork server's loop */
+static void zygserve(int sock)
+{
+    struct zygreq_t req;
+    struct zygrep_t rep;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr align;
+    } ctl;
+    char *strs = NULL, **vec = NULL, *p;
+    size_t strcap = 0, veccap = 0;
+    int fds[3], errpipe[2], i, n;
+    ssize_t rc;
+
+    setpgid(0, 0);
+    while (1) {
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &req;
+	iov.iov_len = sizeof(req);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if ((rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    _exit(0);               /* the shell is gone */
+	}
+	if ((cm = CMSG_FIRSTHDR(&msg)) == NULL || cm->cmsg_type != SCM_RIGHTS ||
+	    cm->cmsg_len != CMSG_LEN(3 * sizeof(int)) ||
+	    ((size_t)rc < sizeof(req) && !zygread(sock, (char *)&req + rc, sizeof(req) - rc)))
+	    _exit(1);
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+	/* the strings, and argv and envp pointing into them */
+	if (req.len > strcap && (strs = realloc(strs, strcap = req.len)) == NULL)
+	    _exit(1);
+	n = req.argc + req.envc + 3;
+	if ((size_t)n > veccap && (vec = realloc(vec, (veccap = n) * sizeof(char *))) == NULL)
+	    _exit(1);
+	if (!zygread(sock, strs, req.len))
+	    _exit(0);
+	p = strs;
+	for (i = 0; i < n; i++) {
+	    if (i == req.argc + 1 || i == n - 1)
+		vec[i] = NULL;
+	    else {
+		vec[i] = p;
+		p += strlen(p) + 1;
+	    }
+	}
+
+	/* vec is path, argv..., NULL, envp..., NULL */
+	rep.pid = 0;
+	rep.err = 0;
+	if (pipe2(errpipe, O_CLOEXEC) < 0)
+	    rep.err = errno;
+	else {
+	    /* like fork(), but the child's parent is the shell */
+	    if ((rep.pid = syscall(SYS_clone, CLONE_PARENT|SIGCHLD, 0, 0, 0, 0)) == 0)
+		zygchild(&req, fds, vec[0], &vec[1], &vec[req.argc + 2], errpipe[1]);
+	    close(errpipe[1]);
+	    if (rep.pid < 0) {
+		rep.err = errno;
+		rep.pid = 0;
+	    }
+	    else if (zygread(errpipe[0], &rep.err, sizeof(rep.err)))
+		rep.pid = 0;        /* the child could not exec, and tells why */
+	    close(errpipe[0]);
+	}
+	for (i = 0; i < 3; i++)
+	    close(fds[i]);
+	if (zygwrite(sock, &rep, sizeof(rep)) < 0)
+	    _exit(0);
+    }
+}
+
+/* zygstart - Start the fork server */
+void zygstart(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0)
+	unix_error("socketpair error");
+    if ((pid = fork()) < 0)
+	unix_error("fork error");
+    if (pid == 0) {
+	close(sv[0]);
+	zygserve(sv[1]);
+    }
+    close(sv[1]);
+    zygfd = fdhigh(sv[0]);
+}
+
+/* 
+ * zygspawn - Have the fork server run path with argv and envp in process
+ *    group pgid, with infd, outfd and the shell's standard error, and its
+ *    signal mask set to *mask. Returns the child's PID, or 0 with errno
+ *    set if it could not be started.
+ */
+pid_t zygspawn(char *path, char **argv, char **envp, sigset_t *mask, pid_t pgid, int infd, int outfd)
+{
+    static char *buf;
+    static size_t cap;
+    struct zygreq_t req;
+    struct zygrep_t rep;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+	char buf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr align;
+    } ctl;
+    int fds[3] = { infd, outfd, STDERR_FILENO };
+    size_t len = strlen(path) + 1, n;
+    char **v;
+
+    /* pack path, argv and the environment */
+    for (v = argv, req.argc = 0; *v != NULL; v++, req.argc++)
+	len += strlen(*v) + 1;
+    for (v = envp, req.envc = 0; *v != NULL; v++, req.envc++)
+	len += strlen(*v) + 1;
+    if (len > cap && (buf = realloc(buf, cap = len)) == NULL)
+	unix_error("zygspawn error");
+    n = strlen(path) + 1;
+    memcpy(buf, path, n);
+    for (v = argv; *v != NULL; v++, n += strlen(buf + n) + 1)
+	strcpy(buf + n, *v);
+    for (v = envp; *v != NULL; v++, n += strlen(buf + n) + 1)
+	strcpy(buf + n, *v);
+    req.pgid = pgid;
+    req.len = len;
+    req.mask = *mask;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    while (sendmsg(zygfd, &msg, MSG_NOSIGNAL) < 0)
+	if (errno != EINTR)
+	    unix_error("fork server error");
+    if (zygwrite(zygfd, buf, len) < 0 || !zygread(zygfd, &rep, sizeof(rep)))
+	unix_error("fork server error");
+    if (rep.pid == 0) {
+	errno = rep.err;
+	return 0;
+    }
+    /* also set the group here, so that it is in place before the next stage joins it */
+    setpgid(rep.pid, pgid ? pgid : rep.pid);
+    return rep.pid;
+}
+/*********************
+ * End fork server
+ *********************/
+
+/*****************
+ * Batch execution
+ *****************/
+
+/*
+ * With -j N the shell runs the lines of a script as background jobs,
+ * keeping up to N of them running at once. The job table is the run
+ * queue: a new line is started whenever sigchld_handler reaps one of
+ * the batch jobs. The output of each line (stdout and stderr of its
+ * commands, and anything the shell itself prints for it) goes to a
+ * pipe that the event loop drains into a per-line buffer, and the
+ * buffers are written out in script order once the line is complete.
+ * The window of lines in flight is bounded so that a slow line cannot
+ * make the shell buffer the output of the whole script. A job that
+ * stops is killed, since nothing could continue it. The shell exits
+ * with the status of the first line that failed, 0 if none did.
+ */
+
+/* batchoutput - Drain the output pipe of a batch line */
+static void batchoutput(struct evsrc_t *src, unsigned int events)
+{
+    struct batchline_t *bl = (struct batchline_t *)src;
+    ssize_t n;
+    char *out;
+
+    while (1) {
+	if (bl->cap - bl->len < MAXLINE) {
+	    if ((out = realloc(bl->out, 2 * bl->cap + MAXLINE)) == NULL)
+		unix_error("batch output error");
+	    bl->out = out;
+	    bl->cap = 2 * bl->cap + MAXLINE;
+	}
+	if ((n = read(src->fd, bl->out + bl->len, bl->cap - bl->len)) > 0) {
+	    bl->len += n;
+	    continue;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n == 0 || errno != EAGAIN) {  /* every writer is gone */
+	    evdel(src);
+	    close(src->fd);
+	    bl->open = 0;
+	}
+	return;
+    }
+}
+
+/* batchfind - Return the line running batch job pgid, NULL if there is none */
+static struct batchline_t *batchfind(pid_t pgid)
+{
+    struct batchline_t *bl;
+    int i;
+
+    for (i = 0; i < batch.count; i++) {
+	bl = &batch.lines[(batch.head + i) % batch.size];
+	if (bl->pgid == pgid && !bl->done)
+	    return bl;
+    }
+    return NULL;
+}
+
+/* batchmsg - Add the shell's message msg to the output of line bl */
+static void batchmsg(struct batchline_t *bl, const char *msg, size_t n)
+{
+    if (bl->cap - bl->len < n) {
+	if ((bl->out = realloc(bl->out, bl->len + n)) == NULL)
+	    unix_error("batch output error");
+	bl->cap = bl->len + n;
+    }
+    memcpy(bl->out + bl->len, msg, n);
+    bl->len += n;
+}
+
+/* 
+ * batchdone - Record that the batch job pgid finished with status.
+ *    Returns 0 if pgid is not a batch job.
+ */
+int batchdone(pid_t pgid, int status)
+{
+    struct batchline_t *bl;
+    char msg[64];
+
+    if ((bl = batchfind(pgid)) == NULL)
+	return 0;
+    bl->done = 1;
+    batch.running--;
+    if (bl->killed)             /* its status is that of the stop */
+	return 1;
+    bl->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (WIFSIGNALED(status))
+	batchmsg(bl, msg, snprintf(msg, sizeof(msg), "job (%d) terminated by signal %d\n",
+				   pgid, WTERMSIG(status)));
+    return 1;
+}
+
+/* 
+ * batchstopped - Kill the batch job pgid, which was stopped with
+ *    status: nothing could continue it, and it would hold its place
+ *    in the window for ever. Returns 0 if pgid is not a batch job.
+ */
+int batchstopped(pid_t pgid, int status)
+{
+    struct batchline_t *bl;
+    char msg[64];
+
+    if ((bl = batchfind(pgid)) == NULL)
+	return 0;
+    if (!bl->killed) {
+	bl->killed = 1;
+	bl->status = 128 + WSTOPSIG(status);
+	batchmsg(bl, msg, snprintf(msg, sizeof(msg), "job (%d) stopped by signal %d, killed\n",
+				   pgid, WSTOPSIG(status)));
+	kill(-pgid, SIGKILL);
+    }
+    return 1;
+}
+
+/* 
+ * batchstart - Start the next line of the script. A line that is a
+ *    single pipeline runs as a background job; anything else (a
+ *    builtin, or several jobs separated by ; or &) is evaluated before
+ *    the next line is started.
+ */
+static void batchstart(char *cmdline)
+{
+    static struct lexer_t lx;
+    static struct pipeline_t pl;
+    struct batchline_t *bl;
+    int fds[2], tok = 0;
+
+    bl = &batch.lines[(batch.head + batch.count++) % batch.size];
+    bl->pgid = 0;
+    bl->done = 1;
+    bl->killed = 0;
+    bl->status = 0;
+    bl->len = 0;
+
+    /* everything printed for this line, by the shell or the commands,
+     * goes to the line's pipe, which the event loop drains meanwhile */
+    if (pipe2(fds, O_CLOEXEC) < 0 || (fds[0] = fdhigh(fds[0])) < 0 ||
+	fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0)
+	unix_error("pipe error");
+    bl->src.fd = fds[0];
+    bl->src.handler = batchoutput;
+    bl->open = 1;
+    if (evadd(&bl->src, EPOLLIN) < 0)
+	unix_error("epoll_ctl error");
+    fflush(stdout);
+    if (dup2(fds[1], STDOUT_FILENO) < 0 || dup2(fds[1], STDERR_FILENO) < 0)
+	unix_error("dup2 error");
+    close(fds[1]);
+
+    if (lexline(&lx, cmdline, strlen(cmdline)) <= 0)
+	bl->status = 2;
+    else if (lx.njobs > 1 || (lx.argv[0] != NULL && !strcmp(lx.argv[0], "time"))) {
+	eval(cmdline);
+	bl->status = laststatus;
+    }
+    else if (nextpipeline(&lx, &tok, &pl), expandjob(&pl), assignjob(&pl))
+	;
+    else if (pl.ncmds == 1 && builtin_cmd(pl.cmds[0], 1, pl.redirs, pl.nredirs))
+	bl->status = laststatus;
+    else if ((bl->pgid = startjob(&pl, BG, cmdline)) == 0)
+	bl->status = 127;
+    else {
+	bl->done = 0;
+	batch.running++;
+    }
+
+    fflush(stdout);
+    if (dup2(batch.stdoutfd, STDOUT_FILENO) < 0 ||
+	dup2(batch.stdoutfd, STDERR_FILENO) < 0)
+	unix_error("dup2 error");
+}
+
+/* batchflush - Write out the lines at the head of the window that are complete */
+static void batchflush(void)
+{
+    struct batchline_t *bl;
+    size_t off;
+    ssize_t n;
+
+    while (batch.count > 0) {
+	bl = &batch.lines[batch.head];
+	if (!bl->done || bl->open)
+	    return;
+	for (off = 0; off < bl->len; off += n)
+	    if ((n = write(batch.stdoutfd, bl->out + off, bl->len - off)) < 0) {
+		if (errno != EINTR)
+		    unix_error("write error");
+		n = 0;
+	    }
+	if (batch.status == 0)
+	    batch.status = bl->status;
+	batch.head = (batch.head + 1) % batch.size;
+	batch.count--;
+    }
+}
+
+/*
+ * runbatch - Run the script with up to batch.maxrun lines at a time.
+ *    Returns 0 if every line succeeded, else the status of the first
+ *    line (in script order) that failed.
+ */
+int runbatch(void)
+{
+    char *cmdline;
+    int eof = 0;
+
+    batch.size = 4 * batch.maxrun;
+    if ((batch.lines = calloc(batch.size, sizeof(struct batchline_t))) == NULL ||
+	(batch.stdoutfd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+	unix_error("runbatch error");
+
+    while (1) {
+	while (!eof && batch.running < batch.maxrun && batch.count < batch.size) {
+	    if ((cmdline = readcmdline()) == NULL)
+		eof = 1;
+	    else if (cmdline[strspn(cmdline, " \t\n")] != '\0')
+		batchstart(cmdline);
+	}
+	batchflush();
+	if (eof && batch.count == 0)
+	    break;
+	evwait(-1);
+    }
+    return batch.status;
+}
+/*********************
+ * End batch execution
+ *********************/
+
+/*********************
+ * Admission control
+ *********************/
+
+/*
+ * Background jobs can be held back so that a script that starts
+ * hundreds of them does not overload the machine. The sched builtin
+ * sets the limits: the number of jobs running in the background, the
+ * 1-minute load average and the memory available. A job started with &
+ * while a limit is reached, or while other jobs are already waiting,
+ * is put in the job list in the QU state, with no process, and in a
+ * heap ordered by priority (set with the nice prefix, lower first) and
+ * then by arrival. Whenever jobs are reaped, sigchld_handler starts
+ * queued jobs for as long as the limits allow. The load and the memory
+ * change on their own, so while they hold jobs back a timer checks
+ * them again every second.
+ */
+
+/* memavail - Return the memory available (MB), -1 if it is unknown */
+static long memavail(void)
+{
+    char buf[4096], *p;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open("/proc/meminfo", O_RDONLY|O_CLOEXEC)) < 0)
+	return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+	return -1;
+    buf[n] = '\0';
+    if ((p = strstr(buf, "MemAvailable:")) == NULL)
+	return -1;
+    return strtol(p + 13, NULL, 10) / 1024;
+}
+
+/* schedadmit - Return 1 if a background job may be started now */
+static int schedadmit(void)
+{
+    double load;
+    long mem;
+
+    if (sched.maxrun > 0 && runningjobs() >= sched.maxrun)
+	return 0;
+    if (sched.maxload > 0 && getloadavg(&load, 1) == 1 && load >= sched.maxload)
+	return 0;
+    if (sched.minmem > 0 && (mem = memavail()) >= 0 && mem < sched.minmem)
+	return 0;
+    return 1;
+}
+
+/* schedfull - Return 1 if a new background job has to be queued */
+int schedfull(void)
+{
+    return sched.nqueued > 0 || !schedadmit();
+}
+
+/* heapless - Return 1 if queued job slot a runs before slot b */
+static int heapless(int a, int b)
+{
+    struct job_t *ja = &jobs->slots[a], *jb = &jobs->slots[b];
+
+    if (ja->prio != jb->prio)
+	return ja->prio < jb->prio;
+    return (int)(ja->seq - jb->seq) < 0;
+}
+
+/* heapfix - Restore the heap order around position i */
+static void heapfix(int i)
+{
+    int *h = sched.heap, n = sched.nqueued, c, t;
+
+    while (i > 0 && heapless(h[i], h[(i - 1) / 2])) {
+	t = h[i], h[i] = h[(i - 1) / 2], h[(i - 1) / 2] = t;
+	i = (i - 1) / 2;
+    }
+    while ((c = 2 * i + 1) < n) {
+	if (c + 1 < n && heapless(h[c + 1], h[c]))
+	    c++;
+	if (!heapless(h[c], h[i]))
+	    break;
+	t = h[i], h[i] = h[c], h[c] = t;
+	i = c;
+    }
+}
+
+/* schedput - Append the n bytes of s to the growable string *buf */
+static void schedput(char **buf, size_t *len, size_t *cap, const char *s, size_t n)
+{
+    if (*len + n + 1 > *cap) {
+	*cap = 2 * (*len + n + 1);
+	if ((*buf = realloc(*buf, *cap)) == NULL)
+	    unix_error("schedqueue error");
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/* schedword - Append word to *buf in single quotes, for lexline to read back */
+static void schedword(char **buf, size_t *len, size_t *cap, const char *word)
+{
+    const char *q;
+
+    schedput(buf, len, cap, " '", 2);
+    for (; (q = strchr(word, '\'')) != NULL; word = q + 1) {
+	schedput(buf, len, cap, word, q - word);
+	schedput(buf, len, cap, "'\\''", 4);
+    }
+    schedput(buf, len, cap, word, strlen(word));
+    schedput(buf, len, cap, "'", 1);
+}
+
+/* 
+ * schedline - Return the expanded job pl as a line that lexes back to
+ *    the same words, so that a queued job runs with the values the
+ *    variables had when it was queued. A group, or an and-or list,
+ *    keeps its text: the subshell that runs it expands it as it goes.
+ *    The line is malloc'd.
+ */
+static char *schedline(struct pipeline_t *pl)
+{
+    static const char *ops[] = { "<", ">", ">>", ">&", "<<<" };
+    struct group_t *g;
+    struct redir_t *r = pl->redirs;
+    char *buf = NULL, op[16], **v;
+    size_t len = 0, cap = 0;
+    int i, n, ng = 0;
+
+    for (i = 0; i < pl->ncmds; i++) {
+	if (i > 0)
+	    schedput(&buf, &len, &cap, " |", 2);
+	if (ng < pl->ngroups && pl->cmds[i] == pl->groups[ng].argv) {
+	    g = &pl->groups[ng++];
+	    if (!pl->list)
+		schedput(&buf, &len, &cap, " {", 2);
+	    schedput(&buf, &len, &cap, " ", 1);
+	    schedput(&buf, &len, &cap, g->lx->line + g->lx->off[g->start],
+		     g->lx->off[g->end] - g->lx->off[g->start]);
+	    if (!pl->list)
+		schedput(&buf, &len, &cap, " }", 2);
+	}
+	else
+	    for (v = pl->cmds[i]; *v != NULL; v++)
+		schedword(&buf, &len, &cap, *v);
+	for (; r < pl->redirs + pl->nredirs && r->stage == i; r++) {
+	    n = snprintf(op, sizeof(op), " %d%s", r->fd, ops[r->op]);
+	    schedput(&buf, &len, &cap, op, n);
+	    schedword(&buf, &len, &cap, r->word);
+	}
+    }
+    return buf;
+}
+
+/* 
+ * schedqueue - Queue the background job pl, whose text is cmdline,
+ *    with priority prio. Returns its JID, 0 on error.
+ */
+int schedqueue(struct pipeline_t *pl, char *cmdline, int prio)
+{
+    struct job_t *job;
+    int *heap, jid;
+
+    if (sched.nqueued == sched.heapcap) {
+	int n = sched.heapcap ? 2 * sched.heapcap : MAXJOBS;
+
+	if ((heap = realloc(sched.heap, n * sizeof(int))) == NULL) {
+	    printf("Tried to create too many jobs\n");
+	    return 0;
+	}
+	sched.heap = heap;
+	sched.heapcap = n;
+    }
+    if ((jid = addqueued(jobs, prio, cmdline)) == 0)
+	return 0;
+    job = getjobjid(jobs, jid);
+    job->seq = sched.seq++;
+    job->runline = schedline(pl);
+    sched.heap[sched.nqueued++] = job - jobs->slots;
+    heapfix(sched.nqueued - 1);
+    return jid;
+}
+
+/* schedremove - Take job out of the queue; returns 0 if it is not queued */
+static int schedremove(struct job_t *job)
+{
+    int i, slot = job - jobs->slots;
+
+    for (i = 0; i < sched.nqueued && sched.heap[i] != slot; i++)
+	;
+    if (i == sched.nqueued)
+	return 0;
+    sched.heap[i] = sched.heap[--sched.nqueued];
+    if (i < sched.nqueued)
+	heapfix(i);
+    return 1;
+}
+
+/* 
+ * schedcancel - Drop the queued job as if it had been killed by signal
+ *    sig before it started
+ */
+void schedcancel(struct job_t *job, int sig)
+{
+    int jid = job->jid;
+
+    if (!schedremove(job))
+	return;
+    deletejobjid(jobs, jid);
+    jobdone(0, jid, sig);
+    ctlevent(jid, 0, sig);
+}
+
+/* 
+ * schedstart - Start the queued job now, in the given state, with its
+ *    JID. Returns its process group ID, 0 if it could not be started.
+ */
+pid_t schedstart(struct job_t *job, int state)
+{
+    static struct lexer_t lx;
+    static struct pipeline_t pl;
+    int tok = 0, jid = job->jid, prio = job->prio;
+    size_t len;
+    char *cmdline, *runline = job->runline;
+    pid_t pgid = 0;
+
+    if (!schedremove(job))
+	return 0;
+
+    /* its expanded line is parsed again; it keeps its JID */
+    cmdline = cmdintern(job->cmdline, job->cmdlen, &len);
+    job->runline = NULL;
+    deletejobjid(jobs, jid);
+    if (lexline(&lx, runline, strlen(runline)) > 0 && nextpipeline(&lx, &tok, &pl)) {
+	nextjid = jid;
+	if (pl.cmds[0][0] != NULL &&
+	    (pgid = startjob(&pl, state, cmdline)) != 0)
+	    schednice(pgid, prio);
+	nextjid = maxjid(jobs) + 1;
+    }
+    cmdrelease(cmdline);
+    free(runline);
+    return pgid;
+}
+
+/* schedtimer - Check the load and the memory again */
+static void schedtimer(struct evsrc_t *src, unsigned int events)
+{
+    uint64_t n;
+
+    if (read(src->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+	unix_error("timerfd read error");
+    schedrun();
+}
+
+/* schedrun - Start queued jobs while the limits allow it */
+void schedrun(void)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    while (sched.nqueued > 0 && schedadmit())
+	schedstart(&jobs->slots[sched.heap[0]], BG);
+
+    /* only the end of a job changes the number of jobs running */
+    if (sched.nqueued > 0 && (sched.maxload > 0 || sched.minmem > 0))
+	its.it_value.tv_sec = 1;
+    else if (sched.timer.fd < 0)
+	return;
+    if (sched.timer.fd < 0) {
+	if ((sched.timer.fd = fdhigh(timerfd_create(CLOCK_MONOTONIC, 
+						    TFD_NONBLOCK|TFD_CLOEXEC))) < 0)
+	    unix_error("timerfd error");
+	sched.timer.handler = schedtimer;
+	if (evadd(&sched.timer, EPOLLIN) < 0)
+	    unix_error("epoll_ctl error");
+    }
+    if (timerfd_settime(sched.timer.fd, 0, &its, NULL) < 0)
+	unix_error("timerfd error");
+}
+
+/* 
+ * niceprefix - Skip the prefix nice [-n N] of *argvp and return the
+ *    priority it gives (10 without -n), 0 if there is no prefix or
+ *    no command at all (a line of redirections only)
+ */
+int niceprefix(char ***argvp)
+{
+    char **argv = *argvp;
+    int prio = 10;
+
+    if (argv[0] == NULL || strcmp(argv[0], "nice"))
+	return 0;
+    argv++;
+    if (argv[0] != NULL && !strcmp(argv[0], "-n") && argv[1] != NULL) {
+	prio = atoi(argv[1]);
+	argv += 2;
+    }
+    *argvp = argv;
+    return prio;
+}
+
+/* schednice - Lower the scheduling priority of the processes of job pgid */
+void schednice(pid_t pgid, int prio)
+{
+    /* raising it needs privileges; the job just runs as it is then */
+    if (prio != 0)
+	setpriority(PRIO_PGRP, pgid, getpriority(PRIO_PROCESS, 0) + prio);
+}
+/*********************
+ * End admission control
+ *********************/
+
+/****************
+ * Script cache
+ ****************/
+
+/*
+ * A script given on the command line is run line by line, like the
+ * standard input. With -C dir, the script is lexed once into a compact
+ * binary image, stored in dir under a name derived from the script's
+ * path, and later runs map that image instead of reading and lexing
+ * the script again. The image holds, for every line, its text and the
+ * lexer's output: the token types and offsets, which the lexer_t of a
+ * line points straight into, and the words, of which only the argv
+ * pointers have to be filled in. The header records the device, inode,
+ * size and modification time of the script, so a script that changed
+ * is compiled again. A line with a syntax error is kept as text and
+ * lexed when it runs, so the error is reported in its place.
+ *
+ * Layout of an image, every part 8-byte aligned:
+ *
+ *   struct scripthdr_t    header, then the script's path
+ *   struct scriptline_t   lines[nlines]
+ *   size_t                offs[ntoks]      token offsets in the line
+ *   int                   types[ntoks]     token types
+ *   uint32_t              words[ntoks]     word of each token in text,
+ *                                          NOWORD for operators
+ *   char                  text[textlen]    lines and words, NUL-terminated
+ *
+ * Each line has ntok + 1 tokens, the last being the terminator lexline
+ * leaves after the tokens.
+ */
+
+#define SCRIPTMAGIC "tshc\0\0\0\6" /* the last byte is the format version */
+#define NOWORD      0xffffffffu
+
+struct scripthdr_t {
+    char magic[8];
+    uint32_t ptrsize;       /* sizeof(size_t) of the shell that wrote it */
+    uint32_t pathlen;       /* length of the path after the header */
+    uint64_t dev, ino;      /* the script it was compiled from */
+    uint64_t size;
+    int64_t mtime, mtimens;
+    uint32_t nlines, ntoks;
+    uint64_t textlen;
+};
+
+/* align8 - Round n up to a multiple of 8 */
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+/* 
+ * scriptcheck - Return 0 if every line of the image that script points
+ *    at stays within it, with ntoks tokens and textlen bytes of text,
+ *    -1 if not: a cache file may be truncated or corrupt
+ */
+static int scriptcheck(uint32_t ntoks, size_t textlen)
+{
+    struct scriptline_t *ln;
+    uint32_t i;
+    size_t len;
+    int k;
+
+    /* so every offset below textlen starts a NUL-terminated string */
+    if (textlen > 0 && script.text[textlen - 1] != '\0')
+	return -1;
+    for (i = 0; i < ntoks; i++)
+	if ((script.words[i] != NOWORD && script.words[i] >= textlen) ||
+	    (script.types[i] & 15) > T_REDIR)
+	    return -1;
+    for (i = 0; i < script.nlines; i++) {
+	ln = &script.lines[i];
+	if (ln->text >= textlen)
+	    return -1;
+	if (ln->ntok <= 0)
+	    continue;
+	if ((uint64_t)ln->tok + ln->ntok + 1 > ntoks)
+	    return -1;
+	len = strlen(script.text + ln->text);
+	for (k = 0; k <= ln->ntok; k++)
+	    if (script.offs[ln->tok + k] > len)
+		return -1;
+    }
+    return 0;
+}
+
+/* scriptlayout - Point script at the parts of its image; -1 if it is invalid */
+static int scriptlayout(void)
+{
+    struct scripthdr_t *h = (struct scripthdr_t *)script.image;
+    size_t off;
+
+    if (script.len < sizeof(*h) || memcmp(h->magic, SCRIPTMAGIC, 8) != 0 ||
+	h->ptrsize != sizeof(size_t))
+	return -1;
+    off = align8(sizeof(*h) + h->pathlen);
+    script.lines = (struct scriptline_t *)(script.image + off);
+    off += align8(h->nlines * sizeof(struct scriptline_t));
+    script.offs = (size_t *)(script.image + off);
+    off += align8(h->ntoks * sizeof(size_t));
+    script.types = (int *)(script.image + off);
+    off += align8(h->ntoks * sizeof(int));
+    script.words = (uint32_t *)(script.image + off);
+    off += align8(h->ntoks * sizeof(uint32_t));
+    script.text = script.image + off;
+    script.nlines = h->nlines;
+    if (off > script.len || h->textlen != script.len - off)
+	return -1;
+    return scriptcheck(h->ntoks, h->textlen);
+}
+
+/* scriptcurrent - Return 1 if header h was compiled from path as it is now */
+static int scriptcurrent(struct scripthdr_t *h, char *path, struct stat *st)
+{
+    return h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+	h->size == (uint64_t)st->st_size && h->mtime == st->st_mtim.tv_sec &&
+	h->mtimens == st->st_mtim.tv_nsec && h->pathlen == strlen(path) &&
+	!memcmp(h + 1, path, h->pathlen);
+}
+
+/* scriptappend - Append len bytes to the growable buffer *buf */
+static size_t scriptappend(char **buf, size_t *used, size_t *cap, const void *data, size_t len)
+{
+    size_t at = *used;
+
+    if (*used + len > *cap) {
+	*cap = 2 * (*used + len) + 4096;
+	if ((*buf = realloc(*buf, *cap)) == NULL)
+	    unix_error("script cache error");
+    }
+    memcpy(*buf + at, data, len);
+    *used += len;
+    return at;
+}
+
+/* 
+ * scriptcompile - Lex the script in src (len bytes) into an image for
+ *    path in script.image
+ */
+static void scriptcompile(char *path, struct stat *st, char *src, size_t len)
+{
+    static struct lexer_t lx = { .quiet = 1 };
+    struct scripthdr_t h;
+    struct scriptline_t ln;
+    char *lines = NULL, *offs = NULL, *types = NULL, *words = NULL, *text = NULL;
+    size_t nlines = 0, nlinecap = 0, noffs = 0, noffcap = 0, ntypes = 0,
+	ntypecap = 0, nwords = 0, nwordcap = 0, ntext = 0, ntextcap = 0;
+    char *p, *nl, *end = src + len, *line = NULL;
+    size_t linelen, linecap = 0, off;
+    uint32_t w;
+    int i;
+
+    for (p = src; p < end; p = nl + 1) {
+	/* the line with its newline, as readcmdline returns it */
+	if ((nl = memchr(p, '\n', end - p)) == NULL)
+	    nl = end;
+	linelen = nl - p + 1;
+	if (linelen + 1 > linecap) {
+	    linecap = 2 * linelen + 64;
+	    if ((line = realloc(line, linecap)) == NULL)
+		unix_error("script cache error");
+	}
+	memcpy(line, p, linelen - 1);
+	line[linelen - 1] = '\n';
+	line[linelen] = '\0';
+
+	ln.text = scriptappend(&text, &ntext, &ntextcap, line, linelen + 1);
+	ln.tok = noffs / sizeof(size_t);
+	ln.ntok = lexline(&lx, line, linelen);
+	ln.njobs = lx.njobs;
+	if (ln.ntok > 0) {
+	    scriptappend(&offs, &noffs, &noffcap, lx.off, (ln.ntok + 1) * sizeof(size_t));
+	    scriptappend(&types, &ntypes, &ntypecap, lx.type, (ln.ntok + 1) * sizeof(int));
+	    for (i = 0; i <= ln.ntok; i++) {
+		w = NOWORD;
+		if (lx.argv[i] != NULL)
+		    w = scriptappend(&text, &ntext, &ntextcap, lx.argv[i], strlen(lx.argv[i]) + 1);
+		scriptappend(&words, &nwords, &nwordcap, &w, sizeof(w));
+	    }
+	}
+	scriptappend(&lines, &nlines, &nlinecap, &ln, sizeof(ln));
+	if (ntext > NOWORD)
+	    app_error("script too large for the cache");
+    }
+    free(line);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCRIPTMAGIC, 8);
+    h.ptrsize = sizeof(size_t);
+    h.pathlen = strlen(path);
+    h.dev = st->st_dev;
+    h.ino = st->st_ino;
+    h.size = st->st_size;
+    h.mtime = st->st_mtim.tv_sec;
+    h.mtimens = st->st_mtim.tv_nsec;
+    h.nlines = nlines / sizeof(struct scriptline_t);
+    h.ntoks = noffs / sizeof(size_t);
+    h.textlen = ntext;
+
+    script.len = align8(sizeof(h) + h.pathlen) + align8(nlines) + align8(noffs) + 
+	align8(ntypes) + align8(nwords) + ntext;
+    if ((script.image = calloc(1, script.len)) == NULL)
+	unix_error("script cache error");
+    script.mapped = 0;
+    memcpy(script.image, &h, sizeof(h));
+    memcpy(script.image + sizeof(h), path, h.pathlen);
+    off = align8(sizeof(h) + h.pathlen);
+    memcpy(script.image + off, lines, nlines);
+    off += align8(nlines);
+    memcpy(script.image + off, offs, noffs);
+    off += align8(noffs);
+    memcpy(script.image + off, types, ntypes);
+    off += align8(ntypes);
+    memcpy(script.image + off, words, nwords);
+    off += align8(nwords);
+    memcpy(script.image + off, text, ntext);
+    free(lines), free(offs), free(types), free(words), free(text);
+}
+
+/* scriptsave - Write the compiled image to cache, atomically */
+static void scriptsave(char *cache)
+{
+    char tmp[PATH_MAX + 16];
+    size_t off;
+    ssize_t n;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+	return;             /* no cache, the script still runs */
+    for (off = 0; off < script.len; off += n)
+	if ((n = write(fd, script.image + off, script.len - off)) < 0) {
+	    if (errno == EINTR) {
+		n = 0;
+		continue;
+	    }
+	    break;
+	}
+    if (close(fd) < 0 || off < script.len || rename(tmp, cache) < 0)
+	unlink(tmp);
+}
+
+/* 
+ * scriptopen - Load the script at path, through the cache in cachedir
+ *    if it is not NULL. Returns -1 if the script cannot be read.
+ */
+int scriptopen(char *path, char *cachedir)
+{
+    char abspath[PATH_MAX], cache[PATH_MAX], *src;
+    struct stat st, cst;
+    uint64_t hash = 14695981039346656037ull; /* FNV-1a */
+    char *p;
+    int fd, cfd;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+	return -1;
+    if (realpath(path, abspath) == NULL)
+	snprintf(abspath, sizeof(abspath), "%s", path);
+
+    /* a cached image that is up to date is used as it is */
+    if (cachedir != NULL) {
+	for (p = abspath; *p != '\0'; p++)
+	    hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+	snprintf(cache, sizeof(cache), "%s/%016llx.tshc", cachedir, 
+		 (unsigned long long)hash);
+	if ((cfd = open(cache, O_RDONLY|O_CLOEXEC)) >= 0) {
+	    if (fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(struct scripthdr_t) &&
+		(script.image = mmap(NULL, cst.st_size, PROT_READ|PROT_WRITE, 
+				     MAP_PRIVATE, cfd, 0)) != MAP_FAILED) {
+		script.len = cst.st_size;
+		script.mapped = 1;
+		if (scriptlayout() == 0 && 
+		    scriptcurrent((struct scripthdr_t *)script.image, abspath, &st)) {
+		    close(cfd);
+		    close(fd);
+		    return 0;
+		}
+		scriptclose();
+	    }
+	    close(cfd);
+	}
+    }
+
+    /* otherwise the script is lexed, and the image saved for next time */
+    src = NULL;
+    if (st.st_size > 0 && 
+	(src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return -1;
+    }
+    close(fd);
+    scriptcompile(abspath, &st, src, st.st_size);
+    if (src != NULL)
+	munmap(src, st.st_size);
+    if (scriptlayout() < 0)
+	app_error("script cache error");
+    if (cachedir != NULL)
+	scriptsave(cache);
+    return 0;
+}
+
+/* scriptclose - Release the script */
+void scriptclose(void)
+{
+    if (script.mapped)
+	munmap(script.image, script.len);
+    else
+	free(script.image);
+    script.image = NULL;
+    script.nlines = 0;
+}
+
+/* 
+ * scriptlexer - Point lx at the tokens of line i of the script. Returns
+ *    the number of tokens, or -1 if the line has to be lexed when run.
+ */
+int scriptlexer(uint32_t i, struct lexer_t *lx)
+{
+    struct scriptline_t *ln = &script.lines[i];
+    uint32_t *words;
+    int k;
+
+    if (ln->ntok <= 0)
+	return ln->ntok;
+    if (ln->ntok + 1 > script.argvcap) {
+	script.argvcap = 2 * (ln->ntok + 1);
+	if ((script.argv = realloc(script.argv, script.argvcap * sizeof(char *))) == NULL)
+	    unix_error("script error");
+    }
+    words = script.words + ln->tok;
+    for (k = 0; k <= ln->ntok; k++)
+	script.argv[k] = words[k] == NOWORD ? NULL : script.text + words[k];
+    lx->argv = script.argv;
+    lx->type = script.types + ln->tok;
+    lx->off = script.offs + ln->tok;
+    lx->ntok = ln->ntok;
+    lx->njobs = ln->njobs;
+    lx->line = script.text + ln->text;
+    return ln->ntok;
+}
+
+/* runscript - Run the lines of the script one after the other */
+void runscript(void)
+{
+    struct lexer_t lx;
+    uint32_t i;
+    int ntok;
+
+    memset(&lx, 0, sizeof(lx));
+    for (i = 0; i < script.nlines; i++) {
+	/* report jobs that finished or stopped since the last command */
+	evwait(0);
+	trace(TR_READ, 0, 0, 0, NULL);
+	if ((ntok = scriptlexer(i, &lx)) < 0)
+	    eval(script.text + script.lines[i].text);
+	else if (ntok > 0)
+	    runlexed(&lx, script.text + script.lines[i].text);
+	if (!driver)
+	    fflush(stdout);
+    }
+}
+/********************
+ * End script cache
+ ********************/
+
+/***********************
+ * Line editor and history
+ ***********************/
+
+/*
+ * When standard input is a terminal the shell reads it in raw mode and
+ * edits the line itself, still from the event loop, so jobs are reaped
+ * while the user types. The history is shared by all shells of a user:
+ * $TSH_HISTORY, or ~/.tsh_history, holds one entry per line and is only
+ * ever appended to, and the file of the same name with .idx added holds
+ * the offset of every entry as a 64-bit integer. Both are mapped, so a
+ * shell starts in constant time however long the history is; only
+ * entries written by a shell that did not index them are scanned. An
+ * entry and its offset are appended under an exclusive flock on the
+ * history, so the shells' entries never interleave. An empty
+ * $TSH_HISTORY keeps the history in no file.
+ *
+ * Up and down (ctrl-p, ctrl-n) recall the entries that start with the
+ * text before the cursor. ctrl-r searches backwards for the entries
+ * that contain what is typed; it runs memrchr over the mapped history
+ * and finds the entry by a binary search of the index.
+ */
+
+/* histunmap - Drop the mappings of the history and its index */
+static void histunmap(void)
+{
+    if (hist.text != NULL)
+	munmap(hist.text, hist.textlen);
+    if (hist.idx != NULL)
+	munmap(hist.idx, hist.idxlen);
+    hist.text = NULL;
+    hist.idx = NULL;
+    hist.textlen = hist.idxlen = hist.n = 0;
+}
+
+/* histmap - Map the history and its index as far as they are written */
+static void histmap(void)
+{
+    struct stat st, ist;
+    size_t idxlen;
+
+    if (hist.fd < 0 || fstat(hist.fd, &st) < 0 || fstat(hist.idxfd, &ist) < 0)
+	return;
+    idxlen = ist.st_size & ~(off_t)7;
+    if ((size_t)st.st_size == hist.textlen && idxlen == hist.idxlen)
+	return;
+    histunmap();
+    if (st.st_size > 0) {
+	hist.text = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist.fd, 0);
+	if (hist.text == MAP_FAILED) {
+	    hist.text = NULL;
+	    return;
+	}
+	hist.textlen = st.st_size;
+    }
+    if (idxlen > 0) {
+	hist.idx = mmap(NULL, idxlen, PROT_READ, MAP_SHARED, hist.idxfd, 0);
+	if (hist.idx == MAP_FAILED) {
+	    hist.idx = NULL;
+	    return;
+	}
+	hist.idxlen = idxlen;
+    }
+
+    /* the text was mapped first, so the index may be a little ahead */
+    hist.n = hist.idxlen / sizeof(uint64_t);
+    while (hist.n > 0 && hist.idx[hist.n-1] >= hist.textlen)
+	hist.n--;
+}
+
+/* histentry - Return entry i of the history and its length in *lenp */
+static const char *histentry(size_t i, size_t *lenp)
+{
+    size_t start = hist.idx[i];
+    size_t end = i + 1 < hist.n ? hist.idx[i+1] : hist.textlen;
+
+    if (end <= start)           /* a damaged index */
+	end = start;
+    else if (hist.text[end-1] == '\n')
+	end--;
+    *lenp = end - start;
+    return hist.text + start;
+}
+
+/* 
+ * histsync - Index the entries at the end of the history that are not
+ *    indexed yet, or the whole history if the index is damaged
+ */
+static void histsync(void)
+{
+    uint64_t offs[512];
+    size_t off, k = 0;
+    char *nl;
+
+    flock(hist.fd, LOCK_EX);
+    histmap();
+    if (hist.n < hist.idxlen / sizeof(uint64_t) ||
+	(hist.n > 1 && hist.idx[hist.n-1] <= hist.idx[hist.n-2])) {
+	histunmap();
+	if (ftruncate(hist.idxfd, 0) < 0)
+	    goto out;
+	histmap();
+    }
+    off = 0;
+    if (hist.n > 0) {
+	off = hist.idx[hist.n-1];
+	nl = memchr(hist.text + off, '\n', hist.textlen - off);
+	off = nl != NULL ? nl - hist.text + 1 : hist.textlen;
+    }
+    while (off < hist.textlen) {
+	offs[k++] = off;
+	if (k == 512) {
+	    if (write(hist.idxfd, offs, k * sizeof(offs[0])) < 0)
+		goto out;
+	    k = 0;
+	}
+	nl = memchr(hist.text + off, '\n', hist.textlen - off);
+	off = nl != NULL ? nl - hist.text + 1 : hist.textlen;
+    }
+    if (k > 0 && write(hist.idxfd, offs, k * sizeof(offs[0])) < 0)
+	goto out;
+ out:
+    flock(hist.fd, LOCK_UN);
+    histmap();
+}
+
+/* histopen - Open the history and bring its index up to date */
+void histopen(void)
+{
+    char path[PATH_MAX], *home, *file = varget("TSH_HISTORY");
+    int n;
+
+    if (file == NULL) {
+	if ((home = varget("HOME")) == NULL)
+	    return;
+	n = snprintf(path, sizeof(path) - 4, "%s/.tsh_history", home);
+    }
+    else
+	n = snprintf(path, sizeof(path) - 4, "%s", file);
+    if (n == 0 || n >= (int)sizeof(path) - 4)
+	return;
+    if ((hist.fd = fdhigh(open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600))) < 0)
+	return;
+    strcat(path, ".idx");
+    if ((hist.idxfd = fdhigh(open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600))) < 0) {
+	close(hist.fd);
+	hist.fd = -1;
+	return;
+    }
+    histsync();
+}
+
+/* histadd - Append line[0..len) to the history, unless it repeats the last entry */
+void histadd(const char *line, size_t len)
+{
+    struct iovec iov[2];
+    struct stat st, ist;
+    const char *last;
+    size_t lastlen;
+    uint64_t off;
+
+    if (hist.fd < 0)
+	return;
+    histmap();
+    if (hist.n > 0) {
+	last = histentry(hist.n - 1, &lastlen);
+	if (lastlen == len && !memcmp(last, line, len))
+	    return;
+    }
+    iov[0].iov_base = (char *)line;
+    iov[0].iov_len = len;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    /* 
+     * a failed write is undone, so that the index keeps one offset per
+     * whole line of the text for the next session to map
+     */
+    flock(hist.fd, LOCK_EX);
+    if (fstat(hist.fd, &st) == 0 && fstat(hist.idxfd, &ist) == 0) {
+	off = st.st_size;
+	if (writev(hist.fd, iov, 2) != (ssize_t)len + 1)
+	    ftruncate(hist.fd, st.st_size);
+	else if (write(hist.idxfd, &off, sizeof(off)) != sizeof(off))
+	    ftruncate(hist.idxfd, ist.st_size);
+    }
+    flock(hist.fd, LOCK_UN);
+}
+
+/* 
+ * histprefix - Return the first entry after (dir 1) or before (dir -1)
+ *    entry from that starts with pre[0..plen) and is not the line being
+ *    edited, hist.n if there is none
+ */
+static size_t histprefix(const char *pre, size_t plen, size_t from, int dir)
+{
+    const char *e;
+    size_t i, len;
+
+    for (i = from; dir < 0 ? i-- > 0 : ++i < hist.n; ) {
+	e = histentry(i, &len);
+	if (len >= plen && !memcmp(e, pre, plen) &&
+	    (len != ed.len || memcmp(e, ed.buf, len)))
+	    return i;
+    }
+    return hist.n;
+}
+
+/* 
+ * histsearch - Return the last entry before entry before that contains
+ *    q[0..qlen), hist.n if there is none
+ */
+static size_t histsearch(const char *q, size_t qlen, size_t before)
+{
+    const char *base = hist.text, *p;
+    size_t end = before < hist.n ? hist.idx[before] : hist.textlen;
+    size_t lo, hi, mid;
+
+    if (hist.n == 0 || qlen == 0 || end < qlen)
+	return hist.n;
+    p = base + end - qlen;
+    while (1) {
+	if ((p = memrchr(base, q[0], p - base + 1)) == NULL)
+	    return hist.n;
+	if (!memcmp(p, q, qlen))
+	    break;              /* q has no newline, so it is within an entry */
+	if (p-- == base)
+	    return hist.n;
+    }
+
+    /* the entry is the last one starting at or before p */
+    lo = 0;
+    hi = hist.n;
+    while (hi - lo > 1) {
+	mid = lo + (hi - lo) / 2;
+	if (hist.idx[mid] <= (size_t)(p - base))
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/* edgrow - Make room for n more bytes in *bufp */
+static void edgrow(char **bufp, size_t *capp, size_t len, size_t n)
+{
+    if (len + n <= *capp)
+	return;
+    *capp = (len + n) * 2 + 64;
+    if ((*bufp = realloc(*bufp, *capp)) == NULL)
+	unix_error("editline error");
+}
+
+/* edput - Append s[0..n) to the line being redrawn */
+static void edput(const char *s, size_t n)
+{
+    edgrow(&ed.out, &ed.outcap, ed.outlen, n);
+    memcpy(ed.out + ed.outlen, s, n);
+    ed.outlen += n;
+}
+
+/* edflush - Write out what was put, in one write */
+static void edflush(void)
+{
+    size_t off = 0;
+    ssize_t rc;
+
+    while (off < ed.outlen) {
+	if ((rc = write(STDOUT_FILENO, ed.out + off, ed.outlen - off)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	off += rc;
+    }
+    ed.outlen = 0;
+}
+
+/* edrefresh - Redraw the prompt and the line, and place the cursor */
+static void edrefresh(const char *prompt)
+{
+    char seq[32];
+
+    edput("\r", 1);
+    if (ed.searching) {
+	if (ed.failed)
+	    edput("(failed reverse-i-search)`", 26);
+	else
+	    edput("(reverse-i-search)`", 19);
+	edput(ed.query, ed.qlen);
+	edput("': ", 3);
+    }
+    else
+	edput(prompt, strlen(prompt));
+    edput(ed.buf, ed.len);
+    edput("\033[K", 3);
+    if (ed.pos < ed.len)
+	edput(seq, snprintf(seq, sizeof(seq), "\033[%zuD", ed.len - ed.pos));
+    edflush();
+}
+
+/* edset - Replace the line with s[0..n), the cursor at pos */
+static void edset(const char *s, size_t n, size_t pos)
+{
+    edgrow(&ed.buf, &ed.cap, 0, n + 2);
+    memmove(ed.buf, s, n);
+    ed.len = n;
+    ed.pos = pos;
+}
+
+/* edsave - Keep the typed line while the history is browsed or searched */
+static void edsave(void)
+{
+    edgrow(&ed.saved, &ed.savedcap, 0, ed.len);
+    memcpy(ed.saved, ed.buf, ed.len);
+    ed.savedlen = ed.len;
+}
+
+/* edcut - Delete buf[from..to) */
+static void edcut(size_t from, size_t to)
+{
+    memmove(ed.buf + from, ed.buf + to, ed.len - to);
+    ed.len -= to - from;
+    if (ed.pos > to)
+	ed.pos -= to - from;
+    else if (ed.pos > from)
+	ed.pos = from;
+}
+
+/* edhistory - Recall the previous (dir -1) or next (dir 1) entry with the prefix */
+static void edhistory(int dir)
+{
+    const char *e;
+    size_t i, len;
+
+    if (!ed.browsing) {
+	edsave();
+	ed.browsing = 1;
+	ed.hpos = hist.n;
+	ed.plen = ed.pos;
+    }
+    if (dir < 0 && ed.hpos == 0)
+	return;
+    if (dir > 0 && ed.hpos == hist.n)
+	return;
+    i = histprefix(ed.saved, ed.plen, ed.hpos, dir);
+    if (i == hist.n && dir < 0)
+	return;                 /* nothing older, stay on the entry */
+    ed.hpos = i;
+    if (i == hist.n)
+	edset(ed.saved, ed.savedlen, ed.savedlen);
+    else {
+	e = histentry(i, &len);
+	edset(e, len, len);
+    }
+}
+
+/* edfind - Search for the query in the entries before entry before */
+static void edfind(size_t before)
+{
+    const char *e, *q;
+    size_t i, len;
+
+    i = histsearch(ed.query, ed.qlen, before);
+    ed.failed = ed.qlen > 0 && i == hist.n;
+    if (i == hist.n)
+	return;
+    ed.match = i;
+    e = histentry(i, &len);
+    q = memmem(e, len, ed.query, ed.qlen);
+    edset(e, len, q - e);
+}
+
+/* 
+ * edsearchkey - Handle key c of a reverse incremental search. Returns
+ *    0 if the search ends and the key is handled like any other.
+ */
+static int edsearchkey(int c)
+{
+    switch (c) {
+    case 18:                    /* ctrl-r: an older match */
+	if (ed.match != hist.n)
+	    edfind(ed.match);
+	return 1;
+    case 127:
+    case 8:
+	if (ed.qlen > 0)
+	    ed.qlen--;
+	ed.match = hist.n;
+	if (ed.qlen == 0) {
+	    ed.failed = 0;
+	    edset(ed.saved, ed.savedlen, ed.savedlen);
+	}
+	else
+	    edfind(hist.n);
+	return 1;
+    case 7:                     /* ctrl-g: give up, back to the typed line */
+	edset(ed.saved, ed.savedlen, ed.savedlen);
+	ed.searching = 0;
+	return 1;
+    }
+    if (c >= ' ' && c != 27) {
+	if (ed.qlen < sizeof(ed.query))
+	    ed.query[ed.qlen++] = c;
+	/* the current match may still do */
+	edfind(ed.match == hist.n ? hist.n : ed.match + 1);
+	return 1;
+    }
+    ed.searching = 0;           /* anything else takes the match */
+    return 0;
+}
+
+/* edescape - Handle byte c of an escape sequence (arrows, home, end, delete) */
+static void edescape(int c)
+{
+    if (ed.esc == 1) {
+	ed.esc = (c == '[' || c == 'O') ? 2 : 0;
+	return;
+    }
+    if (isdigit(c)) {
+	ed.escarg = ed.escarg * 10 + c - '0';
+	return;
+    }
+    if (c == ';')
+	return;
+    ed.esc = 0;
+    if (c != 'A' && c != 'B')
+	ed.browsing = 0;
+    switch (c) {
+    case 'A':
+	edhistory(-1);
+	break;
+    case 'B':
+	edhistory(1);
+	break;
+    case 'C':
+	if (ed.pos < ed.len)
+	    ed.pos++;
+	break;
+    case 'D':
+	if (ed.pos > 0)
+	    ed.pos--;
+	break;
+    case 'H':
+	ed.pos = 0;
+	break;
+    case 'F':
+	ed.pos = ed.len;
+	break;
+    case '~':
+	if (ed.escarg == 1 || ed.escarg == 7)
+	    ed.pos = 0;
+	else if (ed.escarg == 4 || ed.escarg == 8)
+	    ed.pos = ed.len;
+	else if (ed.escarg == 3 && ed.pos < ed.len)
+	    edcut(ed.pos, ed.pos + 1);
+	break;
+    }
+}
+
+/* edkey - Handle typed byte c. Returns 1 at the end of the line, -1 at end of input */
+static int edkey(int c)
+{
+    size_t i;
+
+    if (ed.esc) {
+	edescape(c);
+	return 0;
+    }
+    if (ed.searching && edsearchkey(c))
+	return 0;
+    if (c != 16 && c != 14 && c != 27)
+	ed.browsing = 0;  /* edescape decides for arrows */
+    switch (c) {
+    case '\r':
+    case '\n':
+	return 1;
+    case 4:                     /* ctrl-d: end of input on an empty line */
+	if (ed.len == 0)
+	    return -1;
+	if (ed.pos < ed.len)
+	    edcut(ed.pos, ed.pos + 1);
+	break;
+    case 3:                     /* ctrl-c: drop the line */
+	edput("^C\r\n", 4);
+	edflush();
+	ed.len = ed.pos = 0;
+	break;
+    case 1:                     /* ctrl-a */
+	ed.pos = 0;
+	break;
+    case 5:                     /* ctrl-e */
+	ed.pos = ed.len;
+	break;
+    case 2:                     /* ctrl-b */
+	if (ed.pos > 0)
+	    ed.pos--;
+	break;
+    case 6:                     /* ctrl-f */
+	if (ed.pos < ed.len)
+	    ed.pos++;
+	break;
+    case 127:
+    case 8:
+	if (ed.pos > 0)
+	    edcut(ed.pos - 1, ed.pos);
+	break;
+    case 11:                    /* ctrl-k: kill to the end */
+	ed.len = ed.pos;
+	break;
+    case 21:                    /* ctrl-u: kill to the start */
+	edcut(0, ed.pos);
+	break;
+    case 23:                    /* ctrl-w: kill the word before the cursor */
+	for (i = ed.pos; i > 0 && ed.buf[i-1] == ' '; i--)
+	    ;
+	for (; i > 0 && ed.buf[i-1] != ' '; i--)
+	    ;
+	edcut(i, ed.pos);
+	break;
+    case 12:                    /* ctrl-l: clear the screen */
+	edput("\033[H\033[2J", 7);
+	break;
+    case 16:                    /* ctrl-p */
+	edhistory(-1);
+	break;
+    case 14:                    /* ctrl-n */
+	edhistory(1);
+	break;
+    case 18:                    /* ctrl-r */
+	histmap();
+	edsave();
+	ed.searching = 1;
+	ed.failed = 0;
+	ed.qlen = 0;
+	ed.match = hist.n;
+	break;
+    case 27:
+	ed.esc = 1;
+	ed.escarg = 0;
+	break;
+    default:
+	if (c < ' ')
+	    break;
+	edgrow(&ed.buf, &ed.cap, ed.len, 3);
+	memmove(ed.buf + ed.pos + 1, ed.buf + ed.pos, ed.len - ed.pos);
+	ed.buf[ed.pos++] = c;
+	ed.len++;
+    }
+    return 0;
+}
+
+/* edinit - Turn on line editing if stdin is a terminal, and open the history */
+void edinit(void)
+{
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &ed.cooked) < 0)
+	return;
+    ed.on = 1;
+    histopen();
+}
+
+/* 
+ * editline - Read and edit a line at the terminal, running the event loop
+ *    while no key is pressed. Returns the line with a newline, valid until
+ *    the next call, or NULL at end of input.
+ */
+char *editline(const char *prompt)
+{
+    struct termios raw;
+    ssize_t rc;
+    int done = 0;
+
+    histmap();                  /* take in what other shells added */
+    ed.len = ed.pos = 0;
+    ed.browsing = ed.searching = ed.esc = 0;
+    edgrow(&ed.buf, &ed.cap, 0, 2);
+    fflush(stdout);
+
+    /* the settings saved at startup, whatever the last job left */
+    raw = ed.cooked;
+    raw.c_iflag &= ~(ICRNL|IXON|BRKINT|ISTRIP|INPCK);
+    raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    edrefresh(prompt);
+
+    while (!done) {
+	if (ed.inpos == ed.inlen) {
+	    input.ready = 0;
+	    if (evmod(&input.src, EPOLLIN|EPOLLONESHOT) < 0)
+		unix_error("epoll_ctl error");
+	    while (!input.ready) {
+		evwait(-1);
+		if (!input.ready)
+		    edrefresh(prompt);  /* a job notice may have been printed */
+	    }
+	    rc = read(STDIN_FILENO, ed.in, sizeof(ed.in));
+	    if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+		continue;
+	    if (rc <= 0) {
+		done = -1;
+		break;
+	    }
+	    ed.inpos = 0;
+	    ed.inlen = rc;
+	}
+	while (ed.inpos < ed.inlen && !done)
+	    done = edkey(ed.in[ed.inpos++]);
+	if (!done)
+	    edrefresh(prompt);
+    }
+    ed.searching = 0;
+    edrefresh(prompt);
+    edput("\r\n", 2);
+    edflush();
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &ed.cooked);
+    if (done < 0)
+	return NULL;
+
+    for (rc = 0; rc < (ssize_t)ed.len && isspace((unsigned char)ed.buf[rc]); rc++)
+	;
+    if (rc < (ssize_t)ed.len)
+	histadd(ed.buf, ed.len);
+    ed.buf[ed.len] = '\n';
+    ed.buf[ed.len+1] = '\0';
+    trace(TR_READ, 0, 0, 0, NULL);
+    return ed.buf;
+}
+/*******************************
+ * End line editor and history
+ *******************************/
+
+/*****************
+ * Control socket
+ *****************/
+
+/*
+ * With -S path the shell also listens on a UNIX-domain stream socket,
+ * so that local programs can hand work to one long-lived shell instead
+ * of starting a shell per task. Clients are served by the event loop
+ * like standard input, from the same job table and reaping path, while
+ * the shell waits at the prompt or for a foreground job. A request is a
+ * line, and gets a reply line starting with "ok" or "err":
+ *
+ *   run LINE          run the jobs of LINE in the background, queued if
+ *                     the limits set with sched are reached; replies
+ *                     "ok JID ..." with the jobs' IDs. If a job cannot
+ *                     be started, the rest of LINE is not run and the
+ *                     reply is "err CMD: cannot start", followed by
+ *                     "; started JID ..." when earlier jobs of LINE
+ *                     were started and are still running. A builtin
+ *                     that acts on the shell (cd, wait, quit, ...) is
+ *                     refused the same way with "err CMD: not allowed"
+ *   jobs              a line "JID PGID STATE CMDLINE" per job, then "ok"
+ *   bg JOB, fg JOB    continue a job (JOB is %JID or a PID); fg replies
+ *                     once the job has stopped or finished
+ *   kill [-SIG] JOB   send SIG (TERM by default) to the job
+ *   subscribe         also send "event done JID PGID exit N" (or
+ *                     "signal N") when a job finishes and "event
+ *                     stopped JID PGID signal N" when it stops
+ *
+ * All the requests that arrived are run before the replies are written,
+ * so a client that sends a batch of run lines gets its replies in one
+ * write. Each client is registered EPOLLONESHOT and only re-armed when
+ * its requests are done, so fg can wait in the event loop while other
+ * clients are served. The jobs share the shell's standard input and
+ * output. With -S the shell keeps serving the socket after the end of
+ * its input.
+ */
+
+#define CTLMAXBUF (1 << 20) /* a client that lags further is dropped */
+
+/* ctlsend - Queue s[0..n) for client c, written when its requests are done */
+static void ctlsend(struct ctlclient_t *c, const char *s, size_t n)
+{
+    if (c->dead)
+	return;
+    if (c->outlen + n > CTLMAXBUF) {
+	c->dead = 1;
+	shutdown(c->src.fd, SHUT_RDWR);  /* its handler closes it */
+	return;
+    }
+    if (c->outlen + n > c->outcap) {
+	c->outcap = 2 * (c->outlen + n);
+	if ((c->out = realloc(c->out, c->outcap)) == NULL)
+	    unix_error("control socket error");
+    }
+    memcpy(c->out + c->outlen, s, n);
+    c->outlen += n;
+}
+
+/* ctlprintf - Queue a formatted reply for client c */
+static void ctlprintf(struct ctlclient_t *c, const char *fmt, ...)
+{
+    char buf[MAXLINE];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    ctlsend(c, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+}
+
+/* ctlflush - Write out what is queued for c; -1 if c went away */
+static int ctlflush(struct ctlclient_t *c)
+{
+    size_t off = 0;
+    ssize_t rc;
+
+    while (off < c->outlen) {
+	if ((rc = send(c->src.fd, c->out + off, c->outlen - off, MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != EAGAIN)
+		c->dead = 1;
+	    break;
+	}
+	off += rc;
+    }
+    c->outlen -= off;
+    memmove(c->out, c->out + off, c->outlen);
+    return c->dead ? -1 : 0;
+}
+
+/* ctlarm - Watch c again, for output too if some is left */
+static void ctlarm(struct ctlclient_t *c)
+{
+    if (evmod(&c->src, EPOLLIN|EPOLLONESHOT|(c->outlen ? EPOLLOUT : 0)) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/* ctlclose - Drop client c */
+static void ctlclose(struct ctlclient_t *c)
+{
+    struct ctlclient_t **pc;
+
+    for (pc = &ctl.clients; *pc != c; pc = &(*pc)->next)
+	;
+    *pc = c->next;
+    if (c->subscribed)
+	ctl.nsubs--;
+    evdel(&c->src);
+    close(c->src.fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/* ctljob - Return the job named by arg (%JID or PID), replying err if there is none */
+static struct job_t *ctljob(struct ctlclient_t *c, char *arg)
+{
+    struct job_t *job = NULL;
+
+    if (arg == NULL)
+	ctlprintf(c, "err job required\n");
+    else if (arg[0] == '%' && (job = getjobjid(jobs, atoi(arg + 1))) == NULL)
+	ctlprintf(c, "err %s: No such job\n", arg);
+    else if (arg[0] != '%' && (job = getjobpid(jobs, atoi(arg))) == NULL)
+	ctlprintf(c, "err (%s): No such process\n", arg);
+    return job;
+}
+
+/* ctlsignal - Return the signal named by name (9, KILL or SIGKILL), 0 if none */
+static int ctlsignal(const char *name)
+{
+    const char *abbrev;
+    int sig;
+
+    if (isdigit((unsigned char)*name))
+	return (sig = atoi(name)) > 0 && sig < NSIG ? sig : 0;
+    if (!strncmp(name, "SIG", 3))
+	name += 3;
+    for (sig = 1; sig < NSIG; sig++)
+	if ((abbrev = sigabbrev_np(sig)) != NULL && !strcmp(abbrev, name))
+	    return sig;
+    return 0;
+}
+
+/* ctlrun - Start the jobs of line in the background for client c */
+static void ctlrun(struct ctlclient_t *c, char *line)
+{
+    static struct lexer_t lx = { .quiet = 1 };
+    static struct pipeline_t pl;
+    struct builtin_t *b;
+    char *text, *why, ids[MAXLINE];
+    int tok = 0, prio, jid, n = 0;
+    pid_t pgid;
+
+    if (lexline(&lx, line, strlen(line)) <= 0) {
+	ctlprintf(c, "err syntax error\n");
+	return;
+    }
+    ids[0] = '\0';
+    while (nextpipeline(&lx, &tok, &pl)) {
+	text = lx.njobs == 1 ? line : pipelinetext(&pl);
+	expandjob(&pl);
+	jid = 0;
+	if (assignjob(&pl))
+	    continue;
+	prio = niceprefix(&pl.cmds[0]);
+	if (pl.cmds[0][0] == NULL)
+	    continue;
+
+	/* quit, wait, fg and the like would act on the server itself */
+	why = "cannot start";
+	if (pl.ncmds == 1 && (b = findbuiltin(pl.cmds[0][0])) != NULL && b->inshell)
+	    why = "not allowed";
+	else if (schedfull())
+	    jid = schedqueue(&pl, text, prio);
+	else if ((pgid = startjob(&pl, BG, text)) != 0) {
+	    schednice(pgid, prio);
+	    jid = pid2jid(pgid);
+	}
+	if (jid == 0) {
+	    ctlprintf(c, "err %s: %s%s%s\n", pl.cmds[0][0], why,
+		      n > 0 ? "; started" : "", ids);
+	    return;
+	}
+	if (n < (int)sizeof(ids) - 16)
+	    n += sprintf(ids + n, " %d", jid);
+    }
+    ctlprintf(c, "ok%s\n", ids);
+}
+
+/* ctlrequest - Carry out one request line (without its newline) of client c */
+static void ctlrequest(struct ctlclient_t *c, char *line, size_t len)
+{
+    static const char *names[] = { "", "Foreground", "Running", "Stopped", "Queued" };
+    static char *text;          /* the jobs of a run request */
+    static size_t cap;
+    char *argv[4] = { NULL }, *p = line;
+    struct job_t *job;
+    int i, n, sig;
+
+    if (!strncmp(line, "run ", 4)) {
+	/* the text of the jobs ends in a newline, like a line read */
+	if (len - 2 > cap && (text = realloc(text, cap = 2 * len)) == NULL)
+	    unix_error("control socket error");
+	memcpy(text, line + 4, len - 4);
+	strcpy(text + len - 4, "\n");
+	ctlrun(c, text);
+	return;
+    }
+    for (n = 0; n < 3 && (argv[n] = strsep(&p, " \t")) != NULL; )
+	if (*argv[n] != '\0')
+	    n++;
+    argv[n] = NULL;
+    if (n == 0)
+	return;
+    if (!strcmp(argv[0], "jobs")) {
+	for (i = 0; i < jobs->nslots; i++) {
+	    job = &jobs->slots[i];
+	    if (job->state != UNDEF)
+		ctlprintf(c, "%d %d %s %.*s\n", job->jid, job->pid,
+			  names[job->state], (int)job->cmdlen - 1, job->cmdline);
+	}
+	ctlprintf(c, "ok\n");
+    }
+    else if (!strcmp(argv[0], "bg") || !strcmp(argv[0], "fg")) {
+	if (ctljob(c, argv[1]) == NULL)
+	    return;
+	if (argv[0][0] == 'f' && fgpid(jobs) != 0) {
+	    ctlprintf(c, "err a job is in the foreground\n");
+	    return;
+	}
+	do_bgfg(argv);
+	ctlprintf(c, "ok\n");
+    }
+    else if (!strcmp(argv[0], "kill")) {
+	sig = SIGTERM;
+	if (argv[1] != NULL && argv[1][0] == '-') {
+	    if ((sig = ctlsignal(argv[1] + 1)) == 0) {
+		ctlprintf(c, "err %s: invalid signal\n", argv[1] + 1);
+		return;
+	    }
+	    argv[1] = argv[2];
+	}
+	if ((job = ctljob(c, argv[1])) == NULL)
+	    return;
+	if (job->state == QU)   /* no process yet */
+	    schedcancel(job, sig);
+	else if (kill(-job->pid, sig) < 0) {
+	    ctlprintf(c, "err kill: %s\n", strerror(errno));
+	    return;
+	}
+	ctlprintf(c, "ok\n");
+    }
+    else if (!strcmp(argv[0], "subscribe")) {
+	if (!c->subscribed) {
+	    c->subscribed = 1;
+	    ctl.nsubs++;
+	}
+	ctlprintf(c, "ok\n");
+    }
+    else
+	ctlprintf(c, "err %s: unknown request\n", argv[0]);
+}
+
+/* ctlclient - Read the requests of a client and carry them out */
+static void ctlclient(struct evsrc_t *src, unsigned int events)
+{
+    struct ctlclient_t *c = (struct ctlclient_t *)src;
+    size_t pos = 0;
+    ssize_t rc;
+    char *nl;
+
+    if (events & (EPOLLIN|EPOLLHUP|EPOLLERR)) {
+	while (!c->eof && !c->dead) {
+	    if (c->inlen == c->incap) {
+		if (c->incap >= CTLMAXBUF) {
+		    c->dead = 1;    /* a line that never ends */
+		    break;
+		}
+		c->incap = c->incap ? 2 * c->incap : 4096;
+		if ((c->in = realloc(c->in, c->incap + 1)) == NULL)
+		    unix_error("control socket error");
+	    }
+	    if ((rc = read(src->fd, c->in + c->inlen, c->incap - c->inlen)) > 0)
+		c->inlen += rc;
+	    else if (rc == 0)
+		c->eof = 1;
+	    else if (errno == ECONNRESET)
+		c->dead = 1;
+	    else if (errno != EINTR)
+		break;
+	}
+
+	/* fg may run the event loop, which must not come back to c */
+	c->busy = 1;
+	while (!c->dead && (nl = memchr(c->in + pos, '\n', c->inlen - pos)) != NULL) {
+	    *nl = '\0';
+	    ctlrequest(c, c->in + pos, nl - (c->in + pos));
+	    pos = nl - c->in + 1;
+	}
+	c->busy = 0;
+	c->inlen -= pos;
+	memmove(c->in, c->in + pos, c->inlen);
+    }
+    if (ctlflush(c) < 0 || (c->eof && c->outlen == 0))
+	ctlclose(c);
+    else
+	ctlarm(c);
+}
+
+/* ctlaccept - Take in the clients waiting on the listening socket */
+static void ctlaccept(struct evsrc_t *src, unsigned int events)
+{
+    struct ctlclient_t *c;
+    int fd;
+
+    while ((fd = fdhigh(accept4(src->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))) >= 0) {
+	if ((c = calloc(1, sizeof(struct ctlclient_t))) == NULL)
+	    unix_error("control socket error");
+	c->src.fd = fd;
+	c->src.handler = ctlclient;
+	if (evadd(&c->src, EPOLLIN|EPOLLONESHOT) < 0)
+	    unix_error("epoll_ctl error");
+	c->next = ctl.clients;
+	ctl.clients = c;
+    }
+}
+
+/* ctlevent - Tell the subscribed clients that job jid (pgid) finished or stopped */
+void ctlevent(int jid, pid_t pgid, int status)
+{
+    struct ctlclient_t *c, *next;
+
+    if (ctl.nsubs == 0)
+	return;
+    for (c = ctl.clients; c != NULL; c = next) {
+	next = c->next;
+	if (!c->subscribed)
+	    continue;
+	if (WIFSTOPPED(status))
+	    ctlprintf(c, "event stopped %d %d signal %d\n", jid, pgid, WSTOPSIG(status));
+	else if (WIFSIGNALED(status))
+	    ctlprintf(c, "event done %d %d signal %d\n", jid, pgid, WTERMSIG(status));
+	else
+	    ctlprintf(c, "event done %d %d exit %d\n", jid, pgid, WEXITSTATUS(status));
+	/* a busy client gets it with its replies */
+	if (!c->busy && ctlflush(c) == 0 && c->outlen > 0)
+	    ctlarm(c);
+    }
+}
+
+/* ctlremove - Remove the socket file when the shell exits */
+static void ctlremove(void)
+{
+    if (getpid() == ctl.owner)
+	unlink(ctl.path);
+}
+
+/* ctlopen - Listen for clients on a UNIX-domain socket at path */
+void ctlopen(char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+	app_error("control socket path too long");
+    strcpy(addr.sun_path, path);
+    if ((ctl.src.fd = fdhigh(socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0))) < 0)
+	unix_error("control socket error");
+    unlink(path);               /* left by a shell that was killed */
+    if (bind(ctl.src.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(ctl.src.fd, 64) < 0)
+	unix_error("control socket error");
+    ctl.src.handler = ctlaccept;
+    if (evadd(&ctl.src, EPOLLIN) < 0)
+	unix_error("epoll_ctl error");
+    ctl.path = path;
+    ctl.owner = getpid();
+    atexit(ctlremove);
+}
+/*********************
+ * End control socket
+ *********************/
+
+/*****************
+ * Output capture
+ *****************/
+
+/*
+ * With -O KB the standard output and error of every background job go
+ * to a pipe that the event loop drains into a ring of its own, instead
+ * of to the terminal, and output %jid shows what is kept. readv moves
+ * the data straight from the pipe into the two parts of the ring, so it
+ * is copied once, and only the last KB of a job's output is kept. While
+ * a job is in the foreground or followed with output -f, what it writes
+ * is also copied to the shell's standard output: with tee(2) when that
+ * is a pipe, so the pipe's pages are passed on without a copy, with
+ * write otherwise. The rings of all jobs together take at most
+ * CAPTUREMAX bytes: to make room the rings of the oldest finished jobs
+ * are dropped, and when no room can be made a job's output is simply
+ * not captured.
+ */
+
+/* capfree - Drop the ring c */
+static void capfree(struct capture_t *c)
+{
+    struct capture_t **pc;
+
+    for (pc = &capture.rings; *pc != c; pc = &(*pc)->next)
+	;
+    *pc = c->next;
+    if (c->open) {
+	evdel(&c->src);
+	close(c->src.fd);
+    }
+    munmap(c->ring, capture.size);
+    capture.total -= capture.size;
+    free(c);
+}
+
+/* capreclaim - Drop finished rings, oldest first, until there is room for one more */
+static int capreclaim(void)
+{
+    struct capture_t *c, *oldest;
+
+    while (capture.total + capture.size > CAPTUREMAX) {
+	oldest = NULL;
+	for (c = capture.rings; c != NULL; c = c->next)   /* newest first */
+	    if (!c->open && c->follow == 0)
+		oldest = c;
+	if (oldest == NULL)
+	    return 0;
+	capfree(oldest);
+    }
+    return 1;
+}
+
+/* capwrite - Write the n bytes of c's output that start at byte from */
+void capwrite(struct capture_t *c, uint64_t from, size_t n)
+{
+    size_t off = from % capture.size, k;
+    ssize_t rc;
+
+    while (n > 0) {
+	k = capture.size - off < n ? capture.size - off : n;
+	if ((rc = write(STDOUT_FILENO, c->ring + off, k)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	n -= rc;
+	off = (off + rc) % capture.size;
+    }
+}
+
+/* capevent - Drain the pipe of a captured job into its ring */
+static void capevent(struct evsrc_t *src, unsigned int events)
+{
+    struct capture_t *c = (struct capture_t *)src;
+    struct iovec iov[2];
+    size_t off;
+    ssize_t rc, teed;
+    int show = c->follow > 0 || c->pgid == fgpgid;  /* fg waits for it */
+
+    if (show)
+	fflush(stdout);
+    while (1) {
+	teed = 0;
+	if (show && capture.stdoutpipe &&
+	    (teed = tee(src->fd, STDOUT_FILENO, capture.size, SPLICE_F_NONBLOCK)) < 0)
+	    teed = 0;
+	off = c->head % capture.size;
+	iov[0].iov_base = c->ring + off;
+	iov[0].iov_len = capture.size - off;
+	iov[1].iov_base = c->ring;
+	iov[1].iov_len = off;
+	if ((rc = readv(src->fd, iov, 2)) > 0) {
+	    if (show && rc > teed)
+		capwrite(c, c->head + teed, rc - teed);
+	    c->head += rc;
+	    continue;
+	}
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc == 0) {          /* every process of the job closed it */
+	    evdel(src);
+	    close(src->fd);
+	    c->open = 0;
+	}
+	break;
+    }
+}
+
+/* 
+ * capbegin - Point the shell's standard output and error at the pipe of
+ *    a new ring, so that the job started next inherits it. Returns the
+ *    ring, or NULL if the job is not captured.
+ */
+struct capture_t *capbegin(void)
+{
+    struct capture_t *c;
+    struct stat st;
+    int fds[2];
+
+    if (capture.size == 0 || batch.maxrun || !capreclaim())
+	return NULL;
+    if (capture.stdoutfd < 0) {
+	if ((capture.stdoutfd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+	    unix_error("capture error");
+	capture.stdoutpipe = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    }
+    if ((c = calloc(1, sizeof(struct capture_t))) == NULL)
+	unix_error("capture error");
+    c->ring = mmap(NULL, capture.size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (c->ring == MAP_FAILED)
+	unix_error("capture error");
+    if (pipe2(fds, O_CLOEXEC) < 0 || (fds[0] = fdhigh(fds[0])) < 0)
+	unix_error("pipe error");
+    capture.total += capture.size;
+    c->src.fd = fds[0];
+    c->src.handler = capevent;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fflush(stdout);
+    if (dup2(fds[1], STDOUT_FILENO) < 0 || dup2(fds[1], STDERR_FILENO) < 0)
+	unix_error("dup2 error");
+    close(fds[1]);
+    c->open = 1;
+    c->next = capture.rings;
+    capture.rings = c;
+    return c;
+}
+
+/* 
+ * capend - Give the shell its standard output and error back and start
+ *    draining c for job pgid (0 if none started)
+ */
+void capend(struct capture_t *c, pid_t pgid)
+{
+    struct capture_t *old, *next;
+
+    if (c == NULL)
+	return;
+    if (dup2(capture.stdoutfd, STDOUT_FILENO) < 0 ||
+	dup2(capture.stdoutfd, STDERR_FILENO) < 0)
+	unix_error("dup2 error");
+    if (pgid == 0 || (c->jid = pid2jid(pgid)) == 0) {
+	capfree(c);
+	return;
+    }
+    c->pgid = pgid;
+    if (evadd(&c->src, EPOLLIN) < 0)
+	unix_error("epoll_ctl error");
+
+    /* a finished job that had the same JID is forgotten */
+    for (old = c->next; old != NULL; old = next) {
+	next = old->next;
+	if (old->jid == c->jid && !old->open && old->follow == 0)
+	    capfree(old);
+    }
+}
+
+/* capfind - Return the ring of job arg (%JID or PID), NULL if there is none */
+struct capture_t *capfind(const char *arg)
+{
+    struct capture_t *c;
+    int id = atoi(arg[0] == '%' ? arg + 1 : arg);
+
+    for (c = capture.rings; c != NULL; c = c->next)   /* newest first */
+	if (arg[0] == '%' ? c->jid == id : c->pgid == id)
+	    return c;
+    return NULL;
+}
+
+/*********************
+ * End output capture
+ *********************/
+
+/****************
+ * CPU placement
+ ****************/
+
+/*
+ * Every process inherits the CPU mask of the shell, so background jobs
+ * started side by side compete for the same cores and the scheduler
+ * keeps moving them, and their caches, around. With pin -p each & job
+ * is placed as it starts: on the next of the shell's CPUs in turn
+ * (rr), on the CPU with the fewest jobs placed on it (least), or on
+ * the NUMA node with the fewest jobs (node), where it may use all the
+ * node's CPUs, so its memory stays local and the kernel still balances
+ * within the node. The nodes come from /sys/devices/system/node.
+ * pinbegin gives the shell itself the job's mask just before the
+ * stages are spawned, so every process of the job has it from its
+ * first instruction whichever way it is launched, and pinend gives the
+ * shell its CPUs back. pin CPULIST %jid moves a job that is running
+ * already, threads and children included.
+ */
+
+/* cpulistparse - Set set to the CPUs of cpulist s ("0-3,8"); -1 if s is not one */
+int cpulistparse(const char *s, cpu_set_t *set)
+{
+    char *e;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    do {
+	lo = hi = strtol(s, &e, 10);
+	if (e == s || lo < 0)
+	    return -1;
+	if (*e == '-') {
+	    s = e + 1;
+	    hi = strtol(s, &e, 10);
+	    if (e == s || hi < lo)
+		return -1;
+	}
+	if (hi >= CPU_SETSIZE)
+	    return -1;
+	for (; lo <= hi; lo++)
+	    CPU_SET(lo, set);
+	s = e + 1;
+    } while (*e == ',');
+    return *e == '\0' || *e == '\n' ? 0 : -1;
+}
+
+/* cpulistread - Read the cpulist in file path into set; -1 if there is none */
+int cpulistread(const char *path, cpu_set_t *set)
+{
+    char buf[4096];
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0)
+	return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+	return -1;
+    buf[n] = '\0';
+    return cpulistparse(buf, set);
+}
+
+/* cpulistfmt - Write set as a cpulist into buf, cut short with "..." if it does not fit */
+void cpulistfmt(cpu_set_t *set, char *buf, size_t size)
+{
+    size_t len = 0;
+    int lo, hi, n;
+
+    buf[0] = '\0';
+    for (lo = 0; lo < CPU_SETSIZE; lo = hi + 1) {
+	hi = lo;
+	if (!CPU_ISSET(lo, set))
+	    continue;
+	while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set))
+	    hi++;
+	n = snprintf(buf + len, size - len, hi > lo ? "%s%d-%d" : "%s%d",
+		     len > 0 ? "," : "", lo, hi);
+	if (len + n >= size) {
+	    memcpy(buf + size - 4, "...", 4);
+	    return;
+	}
+	len += n;
+    }
+}
+
+/* pininit - Find the CPUs the shell may use and the NUMA nodes they are on */
+void pininit(void)
+{
+    cpu_set_t online, set;
+    char path[64];
+    int i, n;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &pin.shellset) < 0)
+	unix_error("sched_getaffinity error");
+    pin.ncpus = CPU_COUNT(&pin.shellset);
+    if ((pin.cpus = malloc(pin.ncpus * sizeof(int))) == NULL ||
+	(pin.nodes = malloc(pin.ncpus * sizeof(cpu_set_t))) == NULL)
+	unix_error("pin error");
+    for (i = n = 0; i < CPU_SETSIZE; i++)
+	if (CPU_ISSET(i, &pin.shellset))
+	    pin.cpus[n++] = i;
+
+    /* a node none of whose CPUs the shell may use (or with memory only) is left out */
+    if (cpulistread("/sys/devices/system/node/online", &online) == 0)
+	for (i = 0; i < CPU_SETSIZE; i++) {
+	    if (!CPU_ISSET(i, &online))
+		continue;
+	    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+	    if (cpulistread(path, &set) < 0)
+		continue;
+	    CPU_AND(&pin.nodes[pin.nnodes], &set, &pin.shellset);
+	    if (CPU_COUNT(&pin.nodes[pin.nnodes]) > 0)
+		pin.nnodes++;
+	}
+    if (pin.nnodes == 0)    /* no NUMA: one node has all the CPUs */
+	pin.nodes[pin.nnodes++] = pin.shellset;
+    if ((pin.load = calloc(pin.ncpus + pin.nnodes, sizeof(int))) == NULL)
+	unix_error("pin error");
+    pin.ready = 1;
+}
+
+/* pinset - Set set to the CPUs of entry place of pin.load */
+void pinset(int place, cpu_set_t *set)
+{
+    if (place >= pin.ncpus)
+	*set = pin.nodes[place - pin.ncpus];
+    else {
+	CPU_ZERO(set);
+	CPU_SET(pin.cpus[place], set);
+    }
+}
+
+/* 
+ * pinbegin - Choose where the background job started next runs and
+ *    give the shell that CPU mask, so that its processes inherit it.
+ *    Returns the job's entry in pin.load, -1 if it is not placed.
+ */
+int pinbegin(void)
+{
+    cpu_set_t set;
+    int i, k, n, base, best;
+
+    if (pin.policy == PIN_OFF)
+	return -1;
+    base = pin.policy == PIN_NODE ? pin.ncpus : 0;
+    n = pin.policy == PIN_NODE ? pin.nnodes : pin.ncpus;
+    best = pin.next % n;
+    if (pin.policy != PIN_RR)   /* on a tie, the first one from next on */
+	for (k = 1; k < n; k++) {
+	    i = (pin.next + k) % n;
+	    if (pin.load[base + i] < pin.load[base + best])
+		best = i;
+	}
+    pin.next = best + 1;
+    pinset(base + best, &set);
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &set) < 0)
+	return -1;
+    return base + best;
+}
+
+/* 
+ * pinend - Give the shell its CPUs back and record that job pgid (0 if
+ *    none started) was placed on entry place
+ */
+void pinend(int place, pid_t pgid)
+{
+    struct job_t *job;
+    cpu_set_t set;
+    int k;
+
+    if (place < 0)
+	return;
+    sched_setaffinity(0, sizeof(cpu_set_t), &pin.shellset);
+    if (pgid == 0 || (job = getjobpid(jobs, pgid)) == NULL)
+	return;
+    pinset(place, &set);
+    job->place = place;
+    pin.load[place]++;
+    cpulistfmt(&set, job->cpus, sizeof(job->cpus));
+
+    /* the children of the fork server have its mask, not the shell's */
+    if (zygfd >= 0)
+	for (k = 0; k < job->npids; k++)
+	    sched_setaffinity(job->pids[k], sizeof(cpu_set_t), &set);
+}
+
+/* pintasks - Give every thread of process pid the CPUs in set; -1 if none moved */
+static int pintasks(pid_t pid, cpu_set_t *set)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int rc = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    if ((dir = opendir(path)) == NULL)
+	return sched_setaffinity(pid, sizeof(cpu_set_t), set);
+    while ((d = readdir(dir)) != NULL)
+	if (d->d_name[0] != '.' &&
+	    sched_setaffinity(atoi(d->d_name), sizeof(cpu_set_t), set) == 0)
+	    rc = 0;
+    closedir(dir);
+    return rc;
+}
+
+/* 
+ * pinjob - Give the processes of job, and those they started in its
+ *    process group, the CPUs in set. Returns -1 if none could be moved.
+ */
+int pinjob(struct job_t *job, cpu_set_t *set)
+{
+    struct dirent *d;
+    DIR *dir;
+    pid_t pid;
+    int k, rc = -1;
+
+    for (k = 0; k < job->npids; k++)
+	if (pintasks(job->pids[k], set) == 0)
+	    rc = 0;
+    if ((dir = opendir("/proc")) == NULL)
+	return rc;
+    while ((d = readdir(dir)) != NULL)
+	if ((pid = atoi(d->d_name)) > 0 && getpgid(pid) == job->pid &&
+	    getjobpid(jobs, pid) != job && pintasks(pid, set) == 0)
+	    rc = 0;
+    closedir(dir);
+    if (rc == 0) {          /* it is no longer where the policy put it */
+	if (job->place >= 0)
+	    pin.load[job->place]--;
+	job->place = -1;
+	cpulistfmt(set, job->cpus, sizeof(job->cpus));
+    }
+    return rc;
+}
+
+/********************
+ * End CPU placement
+ ********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+\ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nextfree = -1;
+    job->npids = 0;
+    job->nlive = 0;
+    job->status = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->cmdline = NULL;
+    job->cmdlen = 0;
+    job->prio = 0;
+    job->seq = 0;
+    job->place = -1;
+    job->cpus[0] = '\0';
+    job->runline = NULL;
+}
+
+/* pidhash - Home bucket of pid in the PID index */
+static int pidhash(struct jobtable_t *jobs, pid_t pid)
+{
+    return (int)(((unsigned int)pid * 2654435761u) & jobs->pidmask);
+}
+
+/* pidfind - Return the PID index entry holding pid, -1 if none */
+static int pidfind(struct jobtable_t *jobs, pid_t pid)
+{
+    int i;
+
+    for (i = pidhash(jobs, pid); jobs->pidtab[i].pid != 0; 
+	 i = (i + 1) & jobs->pidmask)
+	if (jobs->pidtab[i].pid == pid)
+	    return i;
+    return -1;
+}
+
+/* pidinsert - Add pid -> slot to the PID index (caller ensures room) */
+static void pidinsert(struct jobtable_t *jobs, pid_t pid, int slot)
+{
+    int i;
+
+    for (i = pidhash(jobs, pid); jobs->pidtab[i].pid > 0; 
+	 i = (i + 1) & jobs->pidmask)
+	;
+    if (jobs->pidtab[i].pid == 0)
+	jobs->pidused++;
+    jobs->pidlive++;
+    jobs->pidtab[i].pid = pid;
+    jobs->pidtab[i].slot = slot;
+}
+
+/* piddelete - Mark PID index entry i as deleted */
+static void piddelete(struct jobtable_t *jobs, int i)
+{
+    jobs->pidtab[i].pid = -1;
+    jobs->pidlive--;
+}
+
+/* 
+ * pidrehash - Rebuild the PID index with size entries, dropping
+ *    deleted entries. Returns -1 if out of memory.
+ */
+static int pidrehash(struct jobtable_t *jobs, int size)
+{
+    struct pident_t *old = jobs->pidtab;
+    int i, oldsize = jobs->pidmask + 1;
+
+    if ((jobs->pidtab = calloc(size, sizeof(struct pident_t))) == NULL) {
+	jobs->pidtab = old;
+	return -1;
+    }
+    jobs->pidmask = size - 1;
+    jobs->pidused = 0;
+    jobs->pidlive = 0;
+    for (i = 0; old != NULL && i < oldsize; i++)
+	if (old[i].pid > 0)
+	    pidinsert(jobs, old[i].pid, old[i].slot);
+    free(old);
+    return 0;
+}
+
+/* 
+ * pidroom - Make room for one more entry in the PID index, keeping it
+ *    at most half full. Returns -1 if out of memory.
+ */
+static int pidroom(struct jobtable_t *jobs)
+{
+    int size = jobs->pidmask + 1;
+
+    if (2 * (jobs->pidused + 1) <= size)
+	return 0;
+    while (2 * (jobs->pidlive + 1) > size)
+	size *= 2;
+    return pidrehash(jobs, size);
+}
+
+/* jobaddpid - Append pid to the processes of job */
+static int jobaddpid(struct job_t *job, pid_t pid)
+{
+    pid_t *pids;
+    int n;
+
+    if (job->npids == job->pidcap) {
+	n = job->pidcap ? 2 * job->pidcap : 1;
+	if ((pids = realloc(job->pids, n * sizeof(pid_t))) == NULL)
+	    return -1;
+	job->pids = pids;
+	job->pidcap = n;
+    }
+    job->pids[job->npids++] = pid;
+    job->nlive++;
+    return 0;
+}
+
+/* 
+ * growjobs - Double the number of job slots and chain the new ones
+ *    onto the free list. Returns -1 if out of memory.
+ */
+static int growjobs(struct jobtable_t *jobs)
+{
+    struct job_t *slots;
+    int i, n = jobs->nslots ? 2 * jobs->nslots : MAXJOBS;
+
+    if ((slots = realloc(jobs->slots, n * sizeof(struct job_t))) == NULL)
+	return -1;
+    jobs->slots = slots;
+    for (i = n - 1; i >= jobs->nslots; i--) {
+	slots[i].pids = NULL;
+	slots[i].pidcap = 0;
+	clearjob(&slots[i]);
+	slots[i].nextfree = jobs->freeslot;
+	jobs->freeslot = i;
+    }
+    jobs->nslots = n;
+
+    /* keep the PID index at most half full */
+    return 4 * n > jobs->pidmask + 1 ? pidrehash(jobs, 4 * n) : 0;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct jobtable_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->freeslot = -1;
+    jobs->fgslot = -1;
+    if (growjobs(jobs) < 0)
+	unix_error("initjobs error");
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct jobtable_t *jobs) 
+{
+    return jobs->maxjid;
+}
+
+/* 
+ * newjid - Pick the job ID for a new job: nextjid, unless it wrapped
+ *    past MAXJID onto an ID that is still in use.
+ */
+static int newjid(struct jobtable_t *jobs)
+{
+    int jid = nextjid;
+
+    if (jid > MAXJID || (jid < jobs->jidcap && jobs->jidtab[jid] != 0)) {
+	for (jid = 1; jid < jobs->jidcap && jobs->jidtab[jid] != 0; jid++)
+	    ;
+	if (jid > MAXJID)
+	    return 0;
+    }
+    if (jid >= jobs->jidcap) {
+	int *tab, n = jobs->jidcap ? 2 * jobs->jidcap : MAXJOBS + 1;
+
+	while (n <= jid)
+	    n *= 2;
+	if ((tab = realloc(jobs->jidtab, n * sizeof(int))) == NULL)
+	    return 0;
+	memset(tab + jobs->jidcap, 0, (n - jobs->jidcap) * sizeof(int));
+	jobs->jidtab = tab;
+	jobs->jidcap = n;
+    }
+    return jid;
+}
+
+/* addjob - Add a job to the job list */
+int addjob(struct jobtable_t *jobs, pid_t pid, int state, char *cmdline) 
+{
+    struct job_t *job;
+    int i, jid;
+    
+    if (pid < 1)
+	return 0;
+
+    if ((jobs->freeslot < 0 && growjobs(jobs) < 0) ||
+	pidroom(jobs) < 0 || (jid = newjid(jobs)) == 0 ||
+	jobaddpid(&jobs->slots[jobs->freeslot], pid) < 0) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+
+    i = jobs->freeslot;
+    job = &jobs->slots[i];
+    jobs->freeslot = job->nextfree;
+    jobs->njobs++;
+
+    job->pid = pid;
+    setjobstate(jobs, job, state);
+    job->jid = jid;
+    job->nextfree = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+    nextjid = jid + 1;
+    if (jid > jobs->maxjid)
+	jobs->maxjid = jid;
+    jobs->jidtab[jid] = i + 1;
+    pidinsert(jobs, pid, i);
+    job->cmdline = cmdintern(cmdline, strlen(cmdline), &job->cmdlen);
+    trace(TR_ADD, pid, jid, state, NULL);
+    if(verbose){
+	printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* 
+ * addqueued - Add a job that waits in the queue and has no process
+ *    yet. Returns its JID, 0 on error.
+ */
+int addqueued(struct jobtable_t *jobs, int prio, char *cmdline)
+{
+    struct job_t *job;
+    int i, jid;
+
+    if ((jobs->freeslot < 0 && growjobs(jobs) < 0) ||
+	(jid = newjid(jobs)) == 0) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+
+    i = jobs->freeslot;
+    job = &jobs->slots[i];
+    jobs->freeslot = job->nextfree;
+    jobs->njobs++;
+
+    setjobstate(jobs, job, QU);
+    job->jid = jid;
+    job->prio = prio;
+    job->nextfree = -1;
+    clock_gettime(CLOCK_MONOTONIC, &job->usage.start);
+    nextjid = jid + 1;
+    if (jid > jobs->maxjid)
+	jobs->maxjid = jid;
+    jobs->jidtab[jid] = i + 1;
+    job->cmdline = cmdintern(cmdline, strlen(cmdline), &job->cmdlen);
+    trace(TR_ADD, 0, jid, QU, NULL);
+    return jid;
+}
+
+/* 
+ * addjobpid - Add process pid to the job whose process group is pgid
+ *    (another stage of a pipeline)
+ */
+int addjobpid(struct jobtable_t *jobs, pid_t pgid, pid_t pid)
+{
+    struct job_t *job = getjobpid(jobs, pgid);
+    int slot;
+
+    if (job == NULL || pid < 1)
+	return 0;
+    slot = job - jobs->slots;
+    if (pidroom(jobs) < 0 || jobaddpid(job, pid) < 0) {
+	printf("Tried to create too many jobs\n");
+	return 0;
+    }
+    pidinsert(jobs, pid, slot);
+    return 1;
+}
+
+/* removejob - Delete the job in slot from the job list */
+static void removejob(struct jobtable_t *jobs, int slot)
+{
+    struct job_t *job = &jobs->slots[slot];
+    int i, k;
+
+    for (k = 0; k < job->npids; k++)
+	if ((i = pidfind(jobs, job->pids[k])) >= 0 && 
+	    jobs->pidtab[i].slot == slot)
+	    piddelete(jobs, i);
+    jobs->jidtab[job->jid] = 0;
+    while (jobs->maxjid > 0 && jobs->jidtab[jobs->maxjid] == 0)
+	jobs->maxjid--;
+
+    cmdrelease(job->cmdline);
+    free(job->runline);
+    if (job->place >= 0)
+	pin.load[job->place]--;
+    setjobstate(jobs, job, UNDEF);
+    clearjob(job);
+    job->nextfree = jobs->freeslot;
+    jobs->freeslot = slot;
+    jobs->njobs--;
+    nextjid = maxjid(jobs)+1;
+}
+
+/* deletejob - Delete the job that process pid belongs to from the job list */
+int deletejob(struct jobtable_t *jobs, pid_t pid) 
+{
+    int i;
+
+    if (pid < 1 || (i = pidfind(jobs, pid)) < 0)
+	return 0;
+    removejob(jobs, jobs->pidtab[i].slot);
+    return 1;
+}
+
+/* deletejobjid - Delete job jid (which may have no process) from the job list */
+int deletejobjid(struct jobtable_t *jobs, int jid)
+{
+    if (jid < 1 || jid >= jobs->jidcap || jobs->jidtab[jid] == 0)
+	return 0;
+    removejob(jobs, jobs->jidtab[jid] - 1);
+    return 1;
+}
+
+/* 
+ * deletejobpid - Forget a reaped process of a job that is still running.
+ *    The first process is kept: its PID is the job's process group ID.
+ */
+int deletejobpid(struct jobtable_t *jobs, pid_t pid)
+{
+    int i;
+
+    if (pid < 1 || (i = pidfind(jobs, pid)) < 0 || 
+	jobs->slots[jobs->pidtab[i].slot].pid == pid)
+	return 0;
+    piddelete(jobs, i);
+    return 1;
+}
+
+/* 
+ * setjobstate - Put job in state, keeping count of the running jobs and
+ *    track of the foreground one, so that neither needs a scan
+ */
+void setjobstate(struct jobtable_t *jobs, struct job_t *job, int state)
+{
+    if (job->state == BG)
+	jobs->nrunning--;
+    else if (job->state == FG && jobs->fgslot == job - jobs->slots)
+	jobs->fgslot = -1;
+    job->state = state;
+    if (state == BG)
+	jobs->nrunning++;
+    else if (state == FG)
+	jobs->fgslot = job - jobs->slots;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobtable_t *jobs) {
+    return jobs->fgslot >= 0 ? jobs->slots[jobs->fgslot].pid : 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct jobtable_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1 || (i = pidfind(jobs, pid)) < 0)
+	return NULL;
+    return &jobs->slots[jobs->pidtab[i].slot];
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobtable_t *jobs, int jid) 
+{
+    if (jid < 1 || jid >= jobs->jidcap || jobs->jidtab[jid] == 0)
+	return NULL;
+    return &jobs->slots[jobs->jidtab[jid] - 1];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) 
+{
+    struct job_t *job = getjobpid(jobs, pid);
+
+    return job ? job->jid : 0;
+}
+
+/* addusage - Add the resources used by a terminated process to usage */
+void addusage(struct jobusage_t *usage, struct rusage *ru)
+{
+    timeradd(&usage->utime, &ru->ru_utime, &usage->utime);
+    timeradd(&usage->stime, &ru->ru_stime, &usage->stime);
+    if (ru->ru_maxrss > usage->maxrss)
+	usage->maxrss = ru->ru_maxrss;
+    usage->nvcsw += ru->ru_nvcsw;
+    usage->nivcsw += ru->ru_nivcsw;
+    usage->minflt += ru->ru_minflt;
+    usage->majflt += ru->ru_majflt;
+}
+
+/* elapsed - Wall-clock time of a job in ms, up to now if still running */
+static long elapsed(struct jobusage_t *usage)
+{
+    struct timespec end = usage->end;
+
+    if (end.tv_sec == 0 && end.tv_nsec == 0)
+	clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - usage->start.tv_sec) * 1000 + 
+	(end.tv_nsec - usage->start.tv_nsec) / 1000000;
+}
+
+/* printusage - Print the resources used by a job (time prefix) */
+void printusage(struct jobusage_t *usage)
+{
+    long ms = elapsed(usage);
+
+    printf("real\t%ld.%03lds\n", ms / 1000, ms % 1000);
+    printf("user\t%ld.%03lds\n", (long)usage->utime.tv_sec, 
+	   (long)usage->utime.tv_usec / 1000);
+    printf("sys\t%ld.%03lds\n", (long)usage->stime.tv_sec, 
+	   (long)usage->stime.tv_usec / 1000);
+    printf("maxrss\t%ldKB\n", usage->maxrss);
+    printf("csw\t%ld voluntary, %ld involuntary\n", usage->nvcsw, usage->nivcsw);
+    printf("faults\t%ld minor, %ld major\n", usage->minflt, usage->majflt);
+}
+
+/* 
+ * listjobs - Print the job list. With lflag, also print the PIDs of
+ *    each job and the resources used by its processes reaped so far.
+ */
+void listjobs(struct jobtable_t *jobs, int lflag) 
+{
+    struct job_t *job;
+    struct jobusage_t *u;
+    long ms;
+    int i, k;
+
+    for (i = 0; i < jobs->nslots; i++) {
+	job = &jobs->slots[i];
+	if (job->state != UNDEF) {
+	    if (job->state == QU)   /* no process yet */
+		printf("[%d] ", job->jid);
+	    else
+		printf("[%d] (%d) ", job->jid, job->pid);
+	    switch (job->state) {
+		case BG: 
+		    printf("Running ");
+		    break;
+		case FG: 
+		    printf("Foreground ");
+		    break;
+		case ST: 
+		    printf("Stopped ");
+		    break;
+		case QU: 
+		    printf("Queued ");
+		    break;
+	    default:
+		    printf("listjobs: Internal error: job[%d].state=%d ", 
+			   i, job->state);
+	    }
+	    if (job->cpus[0] != '\0')
+		printf("[cpus %s] ", job->cpus);
+	    printf("%s", job->cmdline);
+	    if (!lflag)
+		continue;
+	    u = &job->usage;
+	    ms = elapsed(u);
+	    printf("    pids");
+	    for (k = 0; k < job->npids; k++)
+		printf(" %d", job->pids[k]);
+	    printf("; real %ld.%03lds user %ld.%03lds sys %ld.%03lds"
+		   " maxrss %ldKB csw %ld/%ld faults %ld/%ld\n",
+		   ms / 1000, ms % 1000,
+		   (long)u->utime.tv_sec, (long)u->utime.tv_usec / 1000,
+		   (long)u->stime.tv_sec, (long)u->stime.tv_usec / 1000,
+		   u->maxrss, u->nvcsw, u->nivcsw, u->minflt, u->majflt);
+	}
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/**********************************************
+ * Helper routines for the command line pool
+ **********************************************/
+
+/* cmdstrhash - FNV-1a hash of the len bytes of text */
+static unsigned int cmdstrhash(const char *text, size_t len)
+{
+    unsigned int h = 2166136261u;
+
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*text++) * 16777619u;
+    return h;
+}
+
+/* cmdpoolgrow - Double the hash table of the pool */
+static void cmdpoolgrow(void)
+{
+    int size = cmdpool.tab ? 2 * (cmdpool.mask + 1) : 64, i;
+    struct cmdstr_t **tab, *cs, *next;
+
+    if ((tab = calloc(size, sizeof(struct cmdstr_t *))) == NULL)
+	unix_error("cmdintern error");
+    if (cmdpool.tab != NULL) {
+	for (i = 0; i <= cmdpool.mask; i++)
+	    for (cs = cmdpool.tab[i]; cs != NULL; cs = next) {
+		next = cs->next;
+		cs->next = tab[cs->hash & (size - 1)];
+		tab[cs->hash & (size - 1)] = cs;
+	    }
+	free(cmdpool.tab);
+    }
+    cmdpool.tab = tab;
+    cmdpool.mask = size - 1;
+}
+
+/* 
+ * cmdintern - Return the pooled copy of the len bytes of text, with a
+ *    newline added if it has none, and its length in *lenp. Every call
+ *    must be matched by a call to cmdrelease.
+ */
+char *cmdintern(const char *text, size_t len, size_t *lenp)
+{
+    struct cmdstr_t *cs;
+    struct strchunk_t *c = cmdpool.cur;
+    unsigned int h;
+    size_t n, need;
+
+    if (len == 0 || text[len-1] != '\n')
+	len++;              /* room for the newline */
+    n = len - 1;            /* bytes to compare before the newline */
+    h = cmdstrhash(text, n);
+    if (cmdpool.tab == NULL)
+	cmdpoolgrow();
+    for (cs = cmdpool.tab[h & cmdpool.mask]; cs != NULL; cs = cs->next)
+	if (cs->hash == h && cs->len == len && !memcmp(cs->text, text, n)) {
+	    cs->refs++;
+	    *lenp = len;
+	    return cs->text;
 	}
-    return;
+
+    /* append a new string to the current chunk, or start a new one */
+    need = sizeof(struct cmdstr_t) + len + 1;
+    need = (need + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (c == NULL || c->size - c->used < need) {
+	if (c != NULL && c->live == 0)
+	    free(c);
+	n = need > STRCHUNK ? need : STRCHUNK;
+	if ((c = malloc(sizeof(struct strchunk_t) + n)) == NULL)
+	    unix_error("cmdintern error");
+	c->size = n;
+	c->used = 0;
+	c->live = 0;
+	cmdpool.cur = c;
+    }
+    cs = (struct cmdstr_t *)(c->data + c->used);
+    c->used += need;
+    c->live++;
+    cs->chunk = c;
+    cs->hash = h;
+    cs->refs = 1;
+    cs->len = len;
+    memcpy(cs->text, text, len - 1);
+    cs->text[len-1] = '\n';
+    cs->text[len] = '\0';
+
+    if (cmdpool.count >= cmdpool.mask + 1)
+	cmdpoolgrow();
+    cs->next = cmdpool.tab[h & cmdpool.mask];
+    cmdpool.tab[h & cmdpool.mask] = cs;
+    cmdpool.count++;
+    *lenp = len;
+    return cs->text;
 }
 
 /* 
- * waitfg - Block until process pid is no longer the foreground process
+ * cmdrelease - Drop a reference to a pooled command line. A chunk is
+ *    freed, or reused if it is the current one, when its last string
+ *    goes away.
  */
- 
-/*
-	waitfg() ensures that there is only one foreground process being executed at any time. This is done by bolcking furher execution until the foreground process running (as given by the pid argument) i.terminates or ii.stops and shifts to the background.
-	
-	Hence, waitfg() is called each time a new process is added in the foreground(FG) state.
-	
-	check_fg is set when a foreground process receives a signal. In case a foreground job is not yet terminated, then pause again until the foreground process terminates. If the foreground process terminates then the if condition ensures that the shell does not pause again for any other process to terminate(i.e. background process).
-*/
-void waitfg(pid_t pid)
+void cmdrelease(char *text)
 {
-	check_fg = 0;
-	pause();
-	/* If check_fg is unmodified even after pause, the foreground process has not terminated yet. Hence, it must pause again until the foreground process terminates. */
-	if(!check_fg)
-		pause();
+    struct cmdstr_t *cs, **pp;
+    struct strchunk_t *c;
+
+    if (text == NULL)
+	return;
+    cs = (struct cmdstr_t *)(text - offsetof(struct cmdstr_t, text));
+    if (--cs->refs > 0)
+	return;
 
+    for (pp = &cmdpool.tab[cs->hash & cmdpool.mask]; *pp != cs; pp = &(*pp)->next)
+	;
+    *pp = cs->next;
+    cmdpool.count--;
+    c = cs->chunk;
+    if (--c->live > 0)
 	return;
+    if (c == cmdpool.cur)
+	c->used = 0;
+    else
+	free(c);
 }
+/*************************************
+ * End command line pool helpers
+ *************************************/
+
 
 /*****************
- * Signal handlers
+ * Event tracing
  *****************/
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminaates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * With -T, the shell records an event for every step in the life of a
+ * job, from reading its command line to deleting it from the job list.
+ * Records are stored in a buffer allocated up front, so recording one
+ * costs a clock_gettime and a few stores and can be done anywhere,
+ * sigchld_handler included. The buffer is formatted and written out
+ * when the event loop is about to block, when it is full, and at exit,
+ * one line per record:
+ *
+ *   <seconds>.<nanoseconds> <event> pid=<pid> jid=<jid> status=<status>
+ *
+ * For stop, exit and reap the status is the wait status; for add and
+ * cont it is the job's new state; for parse, the number of tokens.
  */
-void sigchld_handler(int sig) 
+
+static const char *tracenames[] = {
+    "read", "parse", "fork", "exec", "add", "stop", "cont", "exit", "reap"
+};
+
+/* traceopen - Start tracing to file */
+void traceopen(char *file)
 {
-	pid_t pid;
-	check_fg = 0;
-	int jid; /* job id of the job being considered */
-	int status; 
-	/* status contains information about the status of the job that is stopped or terminated */
-	
-	/*
-		Here, waitpid will check if any child process (due to -1 argument) is terminated (due to WNOHANG) or stopped (due to WUNTRACED) without pausing the parent process and will reap all its child processes.
-		
-		status contains information about the termination or stopping of the process which can be accessed using WIFEXITED, WIFSTOPPED, WIFSIGNALED, etc.
-	*/
-	while((pid = waitpid(-1,&status,WNOHANG|WUNTRACED)) > 0) {
-		jid = pid2jid(pid); /* obtain jid of the job being considered from pid */
-		if(jobs[jid-1].state == FG)
-			check_fg = 1;
-			
-		/* 	
-			WIFEXITED checks if the job has terminated normally after execution.
-		   The job is then deleted from the joblist.
-		 */
-		if(WIFEXITED(status)) {
-			deletejob(jobs,pid);
-		}
-		
-		/*
-			WIFSIGNALED checks if the job terminated on receiving a signal.
-			The job is then deleted from the joblist.
-		*/
-		else if(WIFSIGNALED(status)) {
-			if(WTERMSIG(status) == SIGINT) {
-				deletejob(jobs,pid);
-				printf("job [%d] (%d) terminated by signal %d\n",jid,pid,SIGINT);
-			}
-		}
-		
-		/*
-			WIFSTOPPED checks if the job is stopped on receiving a signal.
-			The state of the job is then changed to ST(i.e.stopped).
-		*/
-		else if(WIFSTOPPED(status)) {
-			getjobpid(jobs,pid)->state = ST;
-			printf("job [%d] (%d) stopped by signal %d\n",jid,pid,SIGTSTP);
-			
-		}
-		
-		
-	}
-    return;
+    if ((tracebuf.fd = fdhigh(open(file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644))) < 0)
+	unix_error("cannot open trace file");
+    if ((tracebuf.recs = malloc(TRACESIZE * sizeof(struct trace_t))) == NULL)
+	unix_error("traceopen error");
+    atexit(traceflush);
 }
 
 /* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ * trace - Record event for process pid of job jid, at *ts or, if ts
+ *    is NULL, now
  */
-/*
-	The process ID of the foreground process is first determined. Then a SIGINT signal is sent to all processes in the foreground process group using (-pid) argument in the kill() function.
-	
-	Each child process has process ID = PID due to call to setpgid() function in eval.
-*/
-void sigint_handler(int sig) 
+void trace(int event, pid_t pid, int jid, int status, struct timespec *ts)
 {
-	pid_t pid = fgpid(jobs); /* PID of the foreground job */
-	/* SIGINT is sent to all processes with group process ID = pid, i.e. processes in the foreground process group. */
-	if(kill(-pid, SIGINT) < 0)
-		unix_error("kill error\n"); 
+    struct trace_t *tr;
+
+    if (tracebuf.fd < 0)
 	return;
+    if (tracebuf.count == TRACESIZE)
+	traceflush();
+    tr = &tracebuf.recs[tracebuf.count++];
+    if (ts != NULL)
+	tr->ts = *ts;
+    else
+	clock_gettime(CLOCK_MONOTONIC, &tr->ts);
+    tr->event = event;
+    tr->pid = pid;
+    tr->jid = jid;
+    tr->status = status;
 }
 
-/*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
- */
-/*
-	The process ID of the foreground process is first determined. Then a SIGTSTP signal is sent to all processes in the foreground process group using (-pid) argument in the kill() function.
-	
-	State of all the job is changed to ST(i.e. stopped).
-	
-	Each child process has process ID = PID due to call to setpgid() function in eval.
-*/
-void sigtstp_handler(int sig) 
+/* traceflush - Write out the buffered trace records */
+void traceflush(void)
 {
-	pid_t pid = fgpid(jobs); /* PID of the foreground job */
-	/* SIGTSTP is sent to all processes with group process ID = pid, i.e. processes in the foreground process group. */
-	if(kill(-pid,SIGTSTP) < 0)
-		unix_error("kill error\n"); 
-	jobs[pid2jid(pid)-1].state = ST; /* state of job is changed to stopped(i.e.'ST')*/
-	    return;
-}
+    char buf[128 * 64];
+    struct trace_t *tr;
+    int i, n = 0;
 
+    for (i = 0; i < tracebuf.count; i++) {
+	tr = &tracebuf.recs[i];
+	n += snprintf(buf + n, sizeof(buf) - n, "%ld.%09ld %s pid=%d jid=%d status=%d\n",
+		      (long)tr->ts.tv_sec, tr->ts.tv_nsec, tracenames[tr->event],
+		      tr->pid, tr->jid, tr->status);
+	if (n > (int)sizeof(buf) - 128 || i == tracebuf.count - 1) {
+	    if (write(tracebuf.fd, buf, n) < 0 && errno != EINTR)
+		break;
+	    n = 0;
+	}
+    }
+    tracebuf.count = 0;
+}
 /*********************
- * End signal handlers
+ * End event tracing
  *********************/
 
-/***********************************************
- * Helper routines that manipulate the job list
-\ **********************************************/
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/**************************************************
+ * Helper routines for the command location cache
+ **************************************************/
+
+/*
+ * Commands without a '/' are searched for in PATH, and the result is
+ * remembered in a hash table keyed by the command name (like the "hash"
+ * builtin of bash), so that running the same command again costs no
+ * filesystem lookups. The cache is flushed when PATH changes, and an
+ * entry is dropped when executing its cached path fails with ENOENT.
+ */
+
+/* cmdhashidx - Bucket of name in the command location cache */
+static unsigned int cmdhashidx(const char *name)
+{
+    unsigned int h = 2166136261u;   /* FNV-1a */
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % CMDHASHSIZE;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+/* hashclear - Forget every cached command location */
+void hashclear(void)
+{
+    struct cmdhash_t *h, *next;
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+    for (i = 0; i < CMDHASHSIZE; i++) {
+	for (h = cmdhash[i]; h != NULL; h = next) {
+	    next = h->next;
+	    free(h->name);
+	    free(h->path);
+	    free(h);
+	}
+	cmdhash[i] = NULL;
+    }
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
+/* hashforget - Drop the cached location of name, 0 if it had none */
+int hashforget(char *name)
 {
-    int i, max=0;
+    struct cmdhash_t **hp, *h;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    for (hp = &cmdhash[cmdhashidx(name)]; (h = *hp) != NULL; hp = &h->next) {
+	if (!strcmp(h->name, name)) {
+	    *hp = h->next;
+	    free(h->name);
+	    free(h->path);
+	    free(h);
+	    return 1;
+	}
+    }
+    return 0;
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* 
+ * pathsearch - Search the directories in PATH for an executable
+ *    called name. Returns a malloc'ed path, or NULL if not found.
+ */
+static char *pathsearch(const char *name, const char *pathvar)
 {
-    int i;
-    
-    if (pid < 1)
-	return 0;
+    const char *dir = pathvar, *end;
+    size_t dlen, nlen = strlen(name);
+    struct stat st;
+    char *path;
+
+    while (1) {
+	end = strchr(dir, ':');
+	dlen = end ? (size_t)(end - dir) : strlen(dir);
+	if ((path = malloc(dlen + nlen + 3)) == NULL)
+	    return NULL;
+	if (dlen == 0)          /* an empty entry means the cwd */
+	    path[dlen++] = '.';
+	else
+	    memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	strcpy(path + dlen + 1, name);
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && 
+	    access(path, X_OK) == 0)
+	    return path;
+	free(path);
+	if (end == NULL)
+	    return NULL;
+	dir = end + 1;
+    }
+}
+
+/* 
+ * findcmd - Return the path to execute for command name: name itself
+ *    if it contains a '/', otherwise its (cached) location in PATH.
+ *    Returns NULL if the command is not found.
+ */
+char *findcmd(char *name)
+{
+    struct cmdhash_t *h;
+    unsigned int i;
+    char *pathvar, *path;
+
+    if (strchr(name, '/') != NULL)
+	return name;
+
+    if ((pathvar = varget("PATH")) == NULL)
+	pathvar = "/usr/bin:/bin";
+    if (cmdhashpath == NULL || strcmp(cmdhashpath, pathvar) != 0) {
+	hashclear();            /* PATH changed since the cache was filled */
+	free(cmdhashpath);
+	cmdhashpath = strdup(pathvar);
+    }
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+    i = cmdhashidx(name);
+    for (h = cmdhash[i]; h != NULL; h = h->next) {
+	if (!strcmp(h->name, name)) {
+	    h->hits++;
+	    return h->path;
 	}
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+
+    if ((path = pathsearch(name, pathvar)) == NULL)
+	return NULL;
+    if ((h = malloc(sizeof(struct cmdhash_t))) == NULL || 
+	(h->name = strdup(name)) == NULL) {
+	free(h);
+	free(path);
+	return NULL;
+    }
+    h->path = path;
+    h->hits = 1;
+    h->next = cmdhash[i];
+    cmdhash[i] = h;
+    return path;
 }
+/***********************************
+ * end command cache helper routines
+ ***********************************/
+
+/**********************************************
+ * Helper routines for the shell's variables
+ **********************************************/
+
+/*
+ * Variables are kept in a hash table, each as its NAME=value string,
+ * and start out as the shell's environment, all exported. Commands are
+ * given env.envp, the exported variables' strings, which is only
+ * rebuilt when a variable is exported or an exported one is unset: a
+ * new value of an exported variable goes straight into its slot. So
+ * starting any number of commands reuses the same array.
+ *
+ * The array has spare slots in front of it. The assignments in front of
+ * a command (VAR=x cmd) are layered on it for that one spawn: a
+ * variable in the array has its slot pointed at the assignment, any
+ * other goes into a spare slot, and envunlayer puts the array back once
+ * the command is started.
+ */
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/* varhash - FNV-1a hash of the name name[0..len) */
+static unsigned int varhash(const char *name, size_t len)
 {
-    int i;
+    unsigned int h = 2166136261u;
 
-    if (pid < 1)
+    while (len-- > 0)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h & (VARHASHSIZE - 1);
+}
+
+/* varnamelen - Length of the name at the start of s, 0 if there is none */
+size_t varnamelen(const char *s)
+{
+    size_t n = 0;
+
+    if (!isalpha((unsigned char)*s) && *s != '_')
 	return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_')
+	n++;
+    return n;
+}
+
+/* isassign - Return the length of the name if word is an assignment NAME=value, else 0 */
+size_t isassign(const char *word)
+{
+    size_t n = varnamelen(word);
+
+    return n > 0 && word[n] == '=' ? n : 0;
+}
+
+/* varfind - Return the variable name[0..len), NULL if it is not set */
+static struct var_t *varfind(const char *name, size_t len)
+{
+    struct var_t *v;
+
+    for (v = vartab[varhash(name, len)]; v != NULL; v = v->next)
+	if (v->namelen == len && !memcmp(v->entry, name, len))
+	    return v;
+    return NULL;
+}
+
+/* varget - Return the value of variable name, NULL if it is not set */
+char *varget(const char *name)
+{
+    size_t len = strlen(name);
+    struct var_t *v = varfind(name, len);
+
+    return v != NULL ? v->entry + len + 1 : NULL;
+}
+
+/* 
+ * varset - Set variable name[0..len) to value, and export it if export
+ *    is set (an exported variable stays exported)
+ */
+void varset(const char *name, size_t len, const char *value, int export)
+{
+    struct var_t *v = varfind(name, len);
+    size_t vlen = strlen(value);
+    char *entry;
+
+    if ((entry = malloc(len + vlen + 2)) == NULL)
+	unix_error("varset error");
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+    if (v == NULL) {
+	unsigned int i = varhash(name, len);
+
+	if ((v = calloc(1, sizeof(struct var_t))) == NULL)
+	    unix_error("varset error");
+	v->namelen = len;
+	v->slot = -1;
+	v->next = vartab[i];
+	vartab[i] = v;
+    }
+    else
+	free(v->entry);
+    v->entry = entry;
+    if (v->slot >= 0)
+	env.envp[v->slot] = entry;  /* the array stays as it is */
+    if (export && !v->exported) {
+	v->exported = 1;
+	env.stale = 1;
+    }
+    if (len == 4 && !memcmp(name, "PATH", 4))
+	hashclear();            /* the cached locations may be wrong now */
+}
+
+/* varunset - Remove variable name; returns 0 if it was not set */
+int varunset(const char *name)
+{
+    size_t len = strlen(name);
+    struct var_t **pv, *v;
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
+    for (pv = &vartab[varhash(name, len)]; (v = *pv) != NULL; pv = &v->next) {
+	if (v->namelen == len && !memcmp(v->entry, name, len)) {
+	    *pv = v->next;
+	    if (v->exported)
+		env.stale = 1;
+	    if (len == 4 && !memcmp(name, "PATH", 4))
+		hashclear();
+	    free(v->entry);
+	    free(v);
 	    return 1;
 	}
     }
     return 0;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* initvars - Make the shell's environment its exported variables */
+void initvars(void)
+{
+    char **e, *eq;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
-    return 0;
+    for (e = environ; *e != NULL; e++)
+	if ((eq = strchr(*e, '=')) != NULL && eq > *e)
+	    varset(*e, eq - *e, eq + 1, 1);
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* envbuild - Rebuild env.envp from the exported variables, with spare slots in front */
+static void envbuild(int spare)
+{
+    struct var_t *v;
+    int i, n = 0;
 
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    for (i = 0; i < VARHASHSIZE; i++)
+	for (v = vartab[i]; v != NULL; v = v->next)
+	    n += v->exported;
+    if (spare < env.spare)
+	spare = env.spare;
+    free(env.base);
+    if ((env.base = malloc((spare + n + 1) * sizeof(char *))) == NULL)
+	unix_error("envbuild error");
+    env.spare = spare;
+    env.envp = env.base + spare;
+    for (i = 0, n = 0; i < VARHASHSIZE; i++) {
+	for (v = vartab[i]; v != NULL; v = v->next) {
+	    v->slot = v->exported ? n : -1;
+	    if (v->exported)
+		env.envp[n++] = v->entry;
+	}
+    }
+    env.envp[n] = NULL;
+    env.stale = 0;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+/* envget - Return the environment for commands, rebuilt if an export changed */
+char **envget(void)
+{
+    if (env.stale || env.base == NULL)
+	envbuild(8);
+    return env.envp;
+}
+
+/* 
+ * envlayer - Return the environment with the n assignments in assigns
+ *    layered on it, until envunlayer is called
+ */
+char **envlayer(char **assigns, int n)
 {
+    struct var_t *v;
+    char **envp;
     int i;
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    envget();
+    if (n > env.spare)
+	envbuild(2 * n);
+    if (n > env.savedcap) {
+	env.savedcap = 2 * n;
+	if ((env.saved = realloc(env.saved, env.savedcap * sizeof(env.saved[0]))) == NULL)
+	    unix_error("envlayer error");
+    }
+    envp = env.envp;
+    for (i = 0; i < n; i++) {
+	v = varfind(assigns[i], isassign(assigns[i]));
+	if (v != NULL && v->slot >= 0) {
+	    env.saved[env.nsaved].slot = v->slot;
+	    env.saved[env.nsaved++].entry = env.envp[v->slot];
+	    env.envp[v->slot] = assigns[i];
+	}
+	else                    /* the later of two comes first, and wins */
+	    *--envp = assigns[i];
+    }
+    return envp;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) 
+/* envunlayer - Put back the slots envlayer changed, newest first */
+void envunlayer(void)
 {
-    int i;
+    while (env.nsaved > 0) {
+	env.nsaved--;
+	env.envp[env.saved[env.nsaved].slot] = env.saved[env.nsaved].entry;
+    }
+}
 
-    if (pid < 1)
-	return 0;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+/* 
+ * varexpand - Return word with each $NAME, ${NAME}, $? and $$ that the
+ *    lexer marked with VARMARK or VARQMARK replaced by its value. The
+ *    result is valid until varexpandreset is called.
+ */
+char *varexpand(const char *word)
+{
+    char *out = NULL, num[16];
+    const char *p, *val;
+    size_t len = 0, cap = 0, n, vlen;
+
+    for (p = word; *p != '\0'; ) {
+	val = p;
+	vlen = 0;
+	if (*p != VARMARK && *p != VARQMARK) {
+	    while (p[vlen] != '\0' && p[vlen] != VARMARK && p[vlen] != VARQMARK)
+		vlen++;
+	    p += vlen;
+	}
+	else if (p[1] == '?' || p[1] == '$') {
+	    snprintf(num, sizeof(num), "%d", p[1] == '?' ? laststatus : (int)getpid());
+	    val = num;
+	    vlen = strlen(num);
+	    p += 2;
+	}
+	else {
+	    int brace = p[1] == '{';
+	    struct var_t *v;
+
+	    p += 1 + brace;
+	    n = varnamelen(p);
+	    v = varfind(p, n);
+	    val = v != NULL ? v->entry + n + 1 : "";
+	    vlen = strlen(val);
+	    p += n + (brace && p[n] == '}');
+	}
+	if (len + vlen + 1 > cap) {
+	    cap = 2 * (len + vlen + 1);
+	    if ((out = realloc(out, cap)) == NULL)
+		unix_error("varexpand error");
+	}
+	memcpy(out + len, val, vlen);
+	len += vlen;
+    }
+    if (out == NULL && (out = malloc(1)) == NULL)
+	unix_error("varexpand error");
+    out[len] = '\0';
+
+    if (expanded.n == expanded.cap) {
+	expanded.cap = expanded.cap ? 2 * expanded.cap : 16;
+	if ((expanded.strs = realloc(expanded.strs, expanded.cap * sizeof(char *))) == NULL)
+	    unix_error("varexpand error");
+    }
+    expanded.strs[expanded.n++] = out;
+    return out;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+/* varexpandreset - Free the words varexpand returned */
+void varexpandreset(void)
 {
+    while (expanded.n > 0)
+	free(expanded.strs[--expanded.n]);
+}
+
+/* 
+ * expandjob - Expand the variables in the words of every stage of pl,
+ *    dropping a word that comes out empty and has no quoted expansion
+ */
+void expandjob(struct pipeline_t *pl)
+{
+    char **v, **w, *e;
     int i;
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG: 
-		    printf("Running ");
-		    break;
-		case FG: 
-		    printf("Foreground ");
-		    break;
-		case ST: 
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
-			   i, jobs[i].state);
-	    }
-	    printf("%s", jobs[i].cmdline);
+
+    varexpandreset();
+    for (i = 0; i < pl->ncmds; i++) {
+	for (v = w = pl->cmds[i]; *v != NULL; v++) {
+	    if (strpbrk(*v, VARMARKS) == NULL)
+		*w++ = *v;
+	    else if (*(e = varexpand(*v)) != '\0' || strchr(*v, VARQMARK) != NULL)
+		*w++ = e;
 	}
+	*w = NULL;
     }
+    for (i = 0; i < pl->nredirs; i++)
+	if (strpbrk(pl->redirs[i].word, VARMARKS) != NULL)
+	    pl->redirs[i].word = varexpand(pl->redirs[i].word);
 }
-/******************************
- * end job list helper routines
- ******************************/
+
+/* assignjob - If pl is only assignments NAME=value, make them and return 1 */
+int assignjob(struct pipeline_t *pl)
+{
+    char **argv = pl->cmds[0], **v;
+    size_t len;
+
+    if (pl->ncmds != 1 || argv[0] == NULL)
+	return 0;
+    for (v = argv; *v != NULL; v++)
+	if (!isassign(*v))
+	    return 0;
+    for (v = argv; *v != NULL; v++) {
+	len = isassign(*v);
+	varset(*v, len, *v + len + 1, 0);
+    }
+    laststatus = 0;
+    return 1;
+}
+
+/* varcmp - Order two NAME=value strings for qsort */
+static int varcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* varexport - Print the exported variables, sorted, as export commands */
+void varexport(void)
+{
+    char **envp = envget(), **sorted;
+    int i, n;
+
+    for (n = 0; envp[n] != NULL; n++)
+	;
+    if ((sorted = malloc((n + 1) * sizeof(char *))) == NULL)
+	unix_error("export error");
+    memcpy(sorted, envp, n * sizeof(char *));
+    qsort(sorted, n, sizeof(char *), varcmp);
+    for (i = 0; i < n; i++)
+	printf("export %s\n", sorted[i]);
+    free(sorted);
+}
+/*********************************
+ * End shell variable helpers
+ *********************************/
 
 
 /***********************
@@ -716,10 +7192,19 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpdfza] [-T file] [-C dir] [-S sock] [-O KB] [-j N] [script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -d   driver mode: like -p, and write output in large blocks\n");
+    printf("   -f   launch jobs with fork+execve instead of posix_spawn\n");
+    printf("   -z   launch jobs through a fork server started at startup\n");
+    printf("   -a   use asynchronous signal handlers instead of a signalfd\n");
+    printf("   -j N run the script file (or stdin) N commands at a time\n");
+    printf("   -T f trace job events to file f\n");
+    printf("   -C d keep scripts lexed once in directory d\n");
+    printf("   -S s take requests on the UNIX-domain socket s\n");
+    printf("   -O k keep the last k KB of each background job's output\n");
     exit(1);
 }
 
@@ -732,6 +7217,22 @@ void unix_error(char *msg)
     exit(1);
 }
 
+/*
+ * fdhigh - Move the new descriptor fd to 10 or above, close-on-exec, out
+ *    of the way of the descriptors a command line redirects (0 to 9).
+ *    Returns the new descriptor, or -1 (with fd closed) on error.
+ */
+int fdhigh(int fd)
+{
+    int hi;
+
+    if (fd < 0 || fd >= 10)
+	return fd;
+    hi = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return hi;
+}
+
 /*
  * app_error - application-style error routine
  */